@@ -0,0 +1,331 @@
+// Microbenchmarks for chunk block storage. Fills maps with create_world
+// terrain and synthetic edit patterns, then reports ns/op, memory per chunk
+// and probe lengths for Map (and Volume for comparison) as JSON on stdout.
+//
+// usage: map_bench [chunks] [seed]
+
+#ifndef _WIN32
+    #define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "map.h"
+#include "volume.h"
+#include "world.h"
+
+#define MAX_BENCH_CHUNKS 256
+#define GET_COUNT 1000000
+#define EDIT_COUNT 200000
+
+static double now() {
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static unsigned int bench_seed;
+
+static unsigned int bench_rand() {
+    // xorshift, so runs are repeatable across platforms
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+static void map_set_func(int x, int y, int z, int w, void *arg) {
+    map_set((Map *)arg, x, y, z, w);
+}
+
+static void volume_set_func(int x, int y, int z, int w, void *arg) {
+    volume_set((Volume *)arg, x, y, z, w);
+}
+
+static size_t map_footprint(Map *map) {
+    return sizeof(Map) + (map->mask + 2) * sizeof(MapEntry) +
+        MAP_WORDS(map->mask) * sizeof(unsigned int);
+}
+
+static size_t volume_footprint(Volume *volume) {
+    size_t result = sizeof(Volume);
+    for (int i = 0; i < VOLUME_SECTIONS; i++) {
+        VolumeSection *section = volume->sections[i];
+        if (section) {
+            result += sizeof(VolumeSection) +
+                VOLUME_SECTION_VOXELS / 8 * section->bits;
+        }
+    }
+    return result;
+}
+
+static void chunk_origin(int index, int *p, int *q) {
+    // chunks are laid out in a square grid centered on the origin
+    int side = 1;
+    while (side * side < MAX_BENCH_CHUNKS) {
+        side++;
+    }
+    *p = index % side - side / 2;
+    *q = index / side - side / 2;
+}
+
+static void random_point(Map *map, int *x, int *y, int *z) {
+    *x = map->dx + bench_rand() % (CHUNK_SIZE + 2);
+    *y = bench_rand() % WORLD_HEIGHT;
+    *z = map->dz + bench_rand() % (CHUNK_SIZE + 2);
+}
+
+static void print_result(
+    int *first, const char *name, double seconds, long ops)
+{
+    printf("%s\n    \"%s\": {\"ops\": %ld, \"ns_per_op\": %.2f}",
+        *first ? "" : ",", name, ops, ops ? seconds * 1e9 / ops : 0.0);
+    *first = 0;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 64;
+    bench_seed = argc > 2 ? (unsigned int)atoi(argv[2]) : 2463534242u;
+    count = count < 1 ? 1 : count;
+    count = count > MAX_BENCH_CHUNKS ? MAX_BENCH_CHUNKS : count;
+    if (!bench_seed) {
+        bench_seed = 1;
+    }
+    map_pool_init();
+    Map *maps = (Map *)calloc(count, sizeof(Map));
+    Volume *volumes = (Volume *)calloc(count, sizeof(Volume));
+    int first = 1;
+    double t;
+    long ops;
+    printf("{\n  \"chunks\": %d,\n  \"results\": {", count);
+
+    // terrain fill, the same work load_chunk does for a fresh chunk
+    long blocks = 0;
+    t = now();
+    for (int i = 0; i < count; i++) {
+        int p, q;
+        chunk_origin(i, &p, &q);
+        map_alloc(&maps[i], p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1, 0x7fff);
+        create_world(p, q, map_set_func, &maps[i]);
+        blocks += maps[i].size;
+    }
+    print_result(&first, "map_fill_terrain", now() - t, blocks);
+    t = now();
+    for (int i = 0; i < count; i++) {
+        int p, q;
+        chunk_origin(i, &p, &q);
+        volume_alloc(&volumes[i], p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1);
+        create_world(p, q, volume_set_func, &volumes[i]);
+    }
+    print_result(&first, "volume_fill_terrain", now() - t, blocks);
+
+    // random lookups across the whole footprint, mostly misses above ground
+    long hits = 0;
+    unsigned int seed = bench_seed;
+    t = now();
+    for (ops = 0; ops < GET_COUNT; ops++) {
+        Map *map = &maps[ops % count];
+        int x, y, z;
+        random_point(map, &x, &y, &z);
+        hits += map_get(map, x, y, z) != 0;
+    }
+    print_result(&first, "map_get_random", now() - t, ops);
+    bench_seed = seed;
+    t = now();
+    for (ops = 0; ops < GET_COUNT; ops++) {
+        Volume *volume = &volumes[ops % count];
+        int x, y, z;
+        random_point(&maps[ops % count], &x, &y, &z);
+        hits -= volume_get(volume, x, y, z) != 0;
+    }
+    print_result(&first, "volume_get_random", now() - t, ops);
+    if (hits) {
+        fprintf(stderr, "map and volume disagree on %ld lookups\n", hits);
+    }
+
+    // lookups of blocks known to exist, as collision and meshing do
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Map *map = &maps[i];
+        MAP_FOR_EACH(map, ex, ey, ez, ew) {
+            hits += map_get(map, ex, ey, ez) == ew;
+            ops++;
+        } END_MAP_FOR_EACH;
+    }
+    print_result(&first, "map_get_hit", now() - t, ops);
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Volume *volume = &volumes[i];
+        VOLUME_FOR_EACH(volume, ex, ey, ez, ew) {
+            hits -= volume_get(volume, ex, ey, ez) == ew;
+            ops++;
+        } END_VOLUME_FOR_EACH;
+    }
+    print_result(&first, "volume_get_hit", now() - t, ops);
+
+    // iteration, per live entry
+    long sum = 0;
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Map *map = &maps[i];
+        MAP_FOR_EACH(map, ex, ey, ez, ew) {
+            (void)ex; (void)ey; (void)ez;
+            sum += ew;
+            ops++;
+        } END_MAP_FOR_EACH;
+    }
+    print_result(&first, "map_for_each", now() - t, ops);
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Volume *volume = &volumes[i];
+        VOLUME_FOR_EACH(volume, ex, ey, ez, ew) {
+            (void)ex; (void)ey; (void)ez;
+            sum -= ew;
+            ops++;
+        } END_VOLUME_FOR_EACH;
+    }
+    print_result(&first, "volume_for_each", now() - t, ops);
+
+    // whole-table copies, per chunk
+    t = now();
+    for (int i = 0; i < count; i++) {
+        Map copy;
+        map_copy(&copy, &maps[i]);
+        map_free(&copy);
+    }
+    print_result(&first, "map_copy", now() - t, count);
+    t = now();
+    for (int i = 0; i < count; i++) {
+        Volume copy;
+        volume_copy(&copy, &volumes[i]);
+        volume_free(&copy);
+    }
+    print_result(&first, "volume_copy", now() - t, count);
+
+    // rehashing a filled table into one twice its size, per chunk
+    t = now();
+    for (int i = 0; i < count; i++) {
+        Map copy;
+        map_copy(&copy, &maps[i]);
+        map_grow(&copy);
+        map_free(&copy);
+    }
+    print_result(&first, "map_copy_and_grow", now() - t, count);
+
+    // synthetic edits: random churn, digging a shaft and building a floor.
+    // both stores get the same edits, so they can be compared afterwards
+    seed = bench_seed;
+    t = now();
+    for (ops = 0; ops < EDIT_COUNT; ops++) {
+        Map *map = &maps[ops % count];
+        int x, y, z;
+        random_point(map, &x, &y, &z);
+        map_set(map, x, y, z, (bench_rand() & 1) ? 1 + bench_rand() % 63 : 0);
+    }
+    print_result(&first, "map_edit_random", now() - t, ops);
+    bench_seed = seed;
+    t = now();
+    for (ops = 0; ops < EDIT_COUNT; ops++) {
+        Volume *volume = &volumes[ops % count];
+        int x, y, z;
+        random_point(&maps[ops % count], &x, &y, &z);
+        volume_set(volume, x, y, z,
+            (bench_rand() & 1) ? 1 + bench_rand() % 63 : 0);
+    }
+    print_result(&first, "volume_edit_random", now() - t, ops);
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Map *map = &maps[i];
+        for (int dx = 1; dx <= 4; dx++) {
+            for (int dz = 1; dz <= 4; dz++) {
+                for (int y = 0; y < 64; y++) {
+                    map_set(map, map->dx + dx, y, map->dz + dz, 0);
+                    ops++;
+                }
+            }
+        }
+    }
+    print_result(&first, "map_edit_dig", now() - t, ops);
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Volume *volume = &volumes[i];
+        for (int dx = 1; dx <= 4; dx++) {
+            for (int dz = 1; dz <= 4; dz++) {
+                for (int y = 0; y < 64; y++) {
+                    volume_set(volume, volume->dx + dx, y, volume->dz + dz, 0);
+                    ops++;
+                }
+            }
+        }
+    }
+    print_result(&first, "volume_edit_dig", now() - t, ops);
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Map *map = &maps[i];
+        for (int dx = 0; dx < CHUNK_SIZE + 2; dx++) {
+            for (int dz = 0; dz < CHUNK_SIZE + 2; dz++) {
+                map_set(map, map->dx + dx, 100, map->dz + dz, 3);
+                ops++;
+            }
+        }
+    }
+    print_result(&first, "map_edit_floor", now() - t, ops);
+    t = now();
+    ops = 0;
+    for (int i = 0; i < count; i++) {
+        Volume *volume = &volumes[i];
+        for (int dx = 0; dx < CHUNK_SIZE + 2; dx++) {
+            for (int dz = 0; dz < CHUNK_SIZE + 2; dz++) {
+                volume_set(volume, volume->dx + dx, 100, volume->dz + dz, 3);
+                ops++;
+            }
+        }
+    }
+    print_result(&first, "volume_edit_floor", now() - t, ops);
+    printf("\n  },\n");
+
+    // memory and probe lengths, both after the same edits
+    size_t map_total = 0;
+    size_t volume_total = 0;
+    unsigned int max_probe = 0;
+    double mean_probe = 0;
+    double load = 0;
+    for (int i = 0; i < count; i++) {
+        MapStats stats;
+        map_stats(&maps[i], &stats);
+        max_probe = stats.max_probe > max_probe ? stats.max_probe : max_probe;
+        mean_probe += stats.mean_probe;
+        load += stats.load;
+        map_total += map_footprint(&maps[i]);
+        volume_total += volume_footprint(&volumes[i]);
+    }
+    printf("  \"memory\": {\"map_bytes_per_chunk\": %.0f, "
+        "\"volume_bytes_per_chunk\": %.0f},\n",
+        (double)map_total / count, (double)volume_total / count);
+    printf("  \"probes\": {\"max\": %u, \"mean\": %.3f, \"load\": %.3f},\n",
+        max_probe, mean_probe / count, load / count);
+    printf("  \"checksum\": %ld\n}\n", sum + hits);
+
+    for (int i = 0; i < count; i++) {
+        map_free(&maps[i]);
+        volume_free(&volumes[i]);
+    }
+    free(maps);
+    free(volumes);
+    map_pool_free();
+    return 0;
+}
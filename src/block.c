@@ -16,12 +16,13 @@ void unset_sign_face(int x, int y, int z, int face, Model *model)
         SignList *signs = &chunk->signs;
         if (sign_list_remove(signs, x, y, z, face))
         {
-            chunk->dirty = 1;
+            set_chunk_dirty(chunk, model);
             db_delete_sign(x, y, z, face);
         }
     }
     else
     {
+        chunk_cache_drop(p, q, model);
         db_delete_sign(x, y, z, face);
     }
 }
@@ -39,11 +40,16 @@ void _set_sign(
     {
         SignList *signs = &chunk->signs;
         sign_list_add(signs, x, y, z, face, text);
+        chunk_hot_update(chunk, model);
         if (dirty)
         {
-            chunk->dirty = 1;
+            set_chunk_dirty(chunk, model);
         }
     }
+    else
+    {
+        chunk_cache_drop(p, q, model);
+    }
     db_insert_sign(p, q, x, y, z, face, text);
 }
 
@@ -65,30 +71,49 @@ void unset_sign(int x, int y, int z, Model *model)
         SignList *signs = &chunk->signs;
         if (sign_list_remove_all(signs, x, y, z))
         {
-            chunk->dirty = 1;
+            set_chunk_dirty(chunk, model);
             db_delete_signs(x, y, z);
         }
     }
     else
     {
+        chunk_cache_drop(p, q, model);
         db_delete_signs(x, y, z);
     }
 }
 
+static void drop_cached_neighborhood(int p, int q, Model *model)
+{
+    // light spills into the neighbors, so their cached meshes go stale too
+    for (int dp = -1; dp <= 1; dp++)
+    {
+        for (int dq = -1; dq <= 1; dq++)
+        {
+            chunk_cache_drop(p + dp, q + dq, model);
+        }
+    }
+}
+
 void set_light(int p, int q, int x, int y, int z, int w, Model *model)
 {
     Chunk *chunk = find_chunk(p, q, model);
     if (chunk)
     {
+        chunk_unpack(chunk, model);
         Map *map = &chunk->lights;
+        int previous = map_get(map, x, y, z);
         if (map_set(map, x, y, z, w))
         {
-            dirty_chunk(chunk, model);
+            // the table may have grown
+            chunk_hot_update(chunk, model);
+            drop_cached_neighborhood(p, q, model);
+            dirty_chunk_near(chunk, x, z, MAX(previous, w), model);
             db_insert_light(p, q, x, y, z, w);
         }
     }
     else
     {
+        drop_cached_neighborhood(p, q, model);
         db_insert_light(p, q, x, y, z, w);
     }
 }
@@ -98,18 +123,22 @@ void _set_block(int p, int q, int x, int y, int z, int w, int dirty, Model *mode
     Chunk *chunk = find_chunk(p, q, model);
     if (chunk)
     {
+        chunk_unpack(chunk, model);
         Map *map = &chunk->map;
         if (map_set(map, x, y, z, w))
         {
+            chunk_hot_update(chunk, model);
             if (dirty)
             {
-                dirty_chunk(chunk, model);
+                dirty_chunk_near(
+                    chunk, x, z, light_reach(chunk, x, y, z, model), model);
             }
             db_insert_block(p, q, x, y, z, w);
         }
     }
     else
     {
+        chunk_cache_drop(p, q, model);
         db_insert_block(p, q, x, y, z, w);
     }
     if (w == 0 && chunked(x) == p && chunked(z) == q)
@@ -162,6 +191,7 @@ int get_block(int x, int y, int z, Model *model)
     Chunk *chunk = find_chunk(p, q, model);
     if (chunk)
     {
+        chunk_unpack(chunk, model);
         Map *map = &chunk->map;
         return map_get(map, x, y, z);
     }
@@ -188,7 +218,7 @@ int player_intersects_block(
 
 void builder_block(int x, int y, int z, int w, Model *model)
 {
-    if (y <= 0 || y >= 256)
+    if (y <= 0 || y >= WORLD_HEIGHT)
     {
         return;
     }
@@ -221,7 +251,7 @@ void paste(Model *model)
     int oy = p1->y - c1->y;
     int dx = ABS(c2->x - c1->x);
     int dz = ABS(c2->z - c1->z);
-    for (int y = 0; y < 256; y++)
+    for (int y = 0; y < WORLD_HEIGHT; y++)
     {
         for (int x = 0; x <= dx; x++)
         {
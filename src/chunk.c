@@ -1,26 +1,552 @@
 #include "config.h"
 #include "structs.h"
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include "util.h"
+#include "chunk.h"
 
 int chunked(float x)
 {
     return floorf(roundf(x) / CHUNK_SIZE);
 }
 
-Chunk *find_chunk(int p, int q, Model *model)
+#define CHUNK_AT(model, slot) \
+    ((model)->chunk_pages[(slot) / CHUNK_PAGE_SIZE] + (slot) % CHUNK_PAGE_SIZE)
+
+// chunk_index is an open addressing table of chunk slots (plus one, so
+// that zero means empty) keyed by (p, q), with linear probing. it is kept
+// at least twice as large as the chunk table so it is never over half full
+static unsigned int chunk_hash(int p, int q, Model *model)
+{
+    unsigned int h = (unsigned int)p * 73856093u ^ (unsigned int)q * 19349663u;
+    return (h ^ (h >> 13)) & model->chunk_index_mask;
+}
+
+static int chunk_index_find(int p, int q, Model *model)
 {
-    for (int i = 0; i < model->chunk_count; i++)
+    if (!model->chunk_index)
+    {
+        return -1;
+    }
+    unsigned int index = chunk_hash(p, q, model);
+    while (model->chunk_index[index])
     {
-        Chunk *chunk = model->chunks + i;
+        Chunk *chunk = CHUNK_AT(model, model->chunk_index[index] - 1);
         if (chunk->p == p && chunk->q == q)
         {
-            return chunk;
+            return index;
+        }
+        index = (index + 1) & model->chunk_index_mask;
+    }
+    return -1;
+}
+
+void chunk_index_insert(Chunk *chunk, Model *model)
+{
+    unsigned int index = chunk_hash(chunk->p, chunk->q, model);
+    while (model->chunk_index[index])
+    {
+        index = (index + 1) & model->chunk_index_mask;
+    }
+    model->chunk_index[index] = chunk->slot + 1;
+}
+
+void chunk_index_remove(Chunk *chunk, Model *model)
+{
+    int index = chunk_index_find(chunk->p, chunk->q, model);
+    if (index < 0)
+    {
+        return;
+    }
+    // shift the rest of the cluster back so lookups need no tombstones
+    unsigned int mask = model->chunk_index_mask;
+    unsigned int hole = index;
+    unsigned int next = (hole + 1) & mask;
+    while (model->chunk_index[next])
+    {
+        Chunk *other = CHUNK_AT(model, model->chunk_index[next] - 1);
+        unsigned int home = chunk_hash(other->p, other->q, model);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            model->chunk_index[hole] = model->chunk_index[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    model->chunk_index[hole] = 0;
+}
+
+static void chunk_table_grow(Model *model)
+{
+    // chunks live in fixed pages so that growing never moves them
+    int page = model->chunk_capacity / CHUNK_PAGE_SIZE;
+    int capacity = model->chunk_capacity + CHUNK_PAGE_SIZE;
+    model->chunk_pages = (Chunk **)realloc(
+        model->chunk_pages, sizeof(Chunk *) * (page + 1));
+    model->chunk_pages[page] = (Chunk *)calloc(CHUNK_PAGE_SIZE, sizeof(Chunk));
+    model->chunks = (Chunk **)realloc(
+        model->chunks, sizeof(Chunk *) * capacity);
+    model->chunk_free = (int *)realloc(
+        model->chunk_free, sizeof(int) * capacity);
+    ChunkHot *hot = &model->chunk_hot;
+    hot->p = (int *)realloc(hot->p, sizeof(int) * capacity);
+    hot->q = (int *)realloc(hot->q, sizeof(int) * capacity);
+    hot->miny = (int *)realloc(hot->miny, sizeof(int) * capacity);
+    hot->maxy = (int *)realloc(hot->maxy, sizeof(int) * capacity);
+    hot->faces = (int *)realloc(hot->faces, sizeof(int) * capacity);
+    hot->sign_faces = (int *)realloc(hot->sign_faces, sizeof(int) * capacity);
+    hot->buffer = (GLuint *)realloc(hot->buffer, sizeof(GLuint) * capacity);
+    hot->sign_buffer = (GLuint *)realloc(
+        hot->sign_buffer, sizeof(GLuint) * capacity);
+    hot->ram = (int *)realloc(hot->ram, sizeof(int) * capacity);
+    hot->vram = (int *)realloc(hot->vram, sizeof(int) * capacity);
+    hot->used = (int *)realloc(hot->used, sizeof(int) * capacity);
+    for (int i = CHUNK_PAGE_SIZE - 1; i >= 0; i--)
+    {
+        int slot = model->chunk_capacity + i;
+        CHUNK_AT(model, slot)->slot = slot;
+        model->chunk_free[model->chunk_free_count++] = slot;
+    }
+    model->chunk_capacity = capacity;
+    if ((unsigned int)capacity * 2 > model->chunk_index_mask + 1)
+    {
+        unsigned int size = model->chunk_index_mask + 1;
+        while ((unsigned int)capacity * 2 > size)
+        {
+            size <<= 1;
+        }
+        free(model->chunk_index);
+        model->chunk_index = (int *)calloc(size, sizeof(int));
+        model->chunk_index_mask = size - 1;
+        for (int i = 0; i < model->chunk_count; i++)
+        {
+            chunk_index_insert(model->chunks[i], model);
+        }
+    }
+}
+
+Chunk *chunk_alloc(Model *model)
+{
+    if (!model->chunk_free_count)
+    {
+        chunk_table_grow(model);
+    }
+    int slot = model->chunk_free[--model->chunk_free_count];
+    Chunk *chunk = CHUNK_AT(model, slot);
+    chunk->order = model->chunk_count;
+    model->chunks[model->chunk_count++] = chunk;
+    return chunk;
+}
+
+void chunk_hot_update(Chunk *chunk, Model *model)
+{
+    ChunkHot *hot = &model->chunk_hot;
+    int i = chunk->order;
+    hot->p[i] = chunk->p;
+    hot->q[i] = chunk->q;
+    hot->miny[i] = chunk->miny;
+    hot->maxy[i] = chunk->maxy;
+    hot->faces[i] = chunk->faces;
+    hot->sign_faces[i] = chunk->sign_faces;
+    hot->buffer[i] = chunk->buffer;
+    hot->sign_buffer[i] = chunk->sign_buffer;
+    if (chunk->packed)
+    {
+        hot->ram[i] = packed_map_bytes(&chunk->packed_map) +
+            packed_map_bytes(&chunk->packed_lights);
+    }
+    else
+    {
+        hot->ram[i] = map_bytes(&chunk->map) + map_bytes(&chunk->lights);
+    }
+    hot->ram[i] += chunk->signs.capacity * sizeof(Sign);
+    hot->vram[i] = 0;
+    if (chunk->buffer)
+    {
+        hot->vram[i] += chunk->faces * 6 * 10 * sizeof(GLfloat);
+    }
+    if (chunk->sign_buffer)
+    {
+        hot->vram[i] += chunk->sign_faces * 6 * 5 * sizeof(GLfloat);
+    }
+}
+
+void chunk_pack(Chunk *chunk, Model *model)
+{
+    if (chunk->packed)
+    {
+        return;
+    }
+    map_pack(&chunk->packed_map, &chunk->map);
+    map_pack(&chunk->packed_lights, &chunk->lights);
+    chunk->packed = 1;
+    chunk_hot_update(chunk, model);
+}
+
+void chunk_unpack(Chunk *chunk, Model *model)
+{
+    if (!chunk->packed)
+    {
+        return;
+    }
+    map_unpack(&chunk->map, &chunk->packed_map);
+    map_unpack(&chunk->lights, &chunk->packed_lights);
+    chunk->packed = 0;
+    chunk_hot_update(chunk, model);
+}
+
+static void cached_chunk_free(CachedChunk *cached)
+{
+    map_free(&cached->map);
+    map_free(&cached->lights);
+    sign_list_free(&cached->signs);
+    del_buffer(cached->buffer);
+    del_buffer(cached->sign_buffer);
+}
+
+static CachedChunk *chunk_cache_oldest(ChunkCache *cache)
+{
+    CachedChunk *result = cache->entries;
+    for (int i = 1; i < cache->count; i++)
+    {
+        if (cache->entries[i].used < result->used)
+        {
+            result = cache->entries + i;
+        }
+    }
+    return result;
+}
+
+int chunk_cache_put(Chunk *chunk, Model *model)
+{
+    ChunkCache *cache = &model->chunk_cache;
+    if (chunk->busy || chunk->packed)
+    {
+        return 0;
+    }
+    CachedChunk *cached = cache->entries;
+    if (cache->count < CHUNK_CACHE_SIZE)
+    {
+        cached += cache->count++;
+    }
+    else
+    {
+        cached = chunk_cache_oldest(cache);
+        cached_chunk_free(cached);
+    }
+    cached->p = chunk->p;
+    cached->q = chunk->q;
+    cached->map = chunk->map;
+    cached->lights = chunk->lights;
+    cached->signs = chunk->signs;
+    cached->faces = chunk->faces;
+    cached->sign_faces = chunk->sign_faces;
+    cached->dirty = chunk->dirty;
+    cached->miny = chunk->miny;
+    cached->maxy = chunk->maxy;
+    cached->buffer = chunk->buffer;
+    cached->sign_buffer = chunk->sign_buffer;
+    cached->used = cache->tick++;
+    return 1;
+}
+
+CachedChunk *chunk_cache_find(int p, int q, Model *model)
+{
+    ChunkCache *cache = &model->chunk_cache;
+    for (int i = 0; i < cache->count; i++)
+    {
+        CachedChunk *cached = cache->entries + i;
+        if (cached->p == p && cached->q == q)
+        {
+            return cached;
         }
     }
     return 0;
 }
 
+void chunk_cache_take(Chunk *chunk, CachedChunk *cached, Model *model)
+{
+    ChunkCache *cache = &model->chunk_cache;
+    chunk->map = cached->map;
+    chunk->lights = cached->lights;
+    chunk->signs = cached->signs;
+    chunk->faces = cached->faces;
+    chunk->sign_faces = cached->sign_faces;
+    chunk->dirty = cached->dirty;
+    chunk->miny = cached->miny;
+    chunk->maxy = cached->maxy;
+    chunk->buffer = cached->buffer;
+    chunk->sign_buffer = cached->sign_buffer;
+    *cached = cache->entries[--cache->count];
+}
+
+void chunk_cache_drop(int p, int q, Model *model)
+{
+    ChunkCache *cache = &model->chunk_cache;
+    CachedChunk *cached = chunk_cache_find(p, q, model);
+    if (cached)
+    {
+        cached_chunk_free(cached);
+        *cached = cache->entries[--cache->count];
+    }
+}
+
+int chunk_cache_evict(Model *model)
+{
+    ChunkCache *cache = &model->chunk_cache;
+    if (!cache->count)
+    {
+        return 0;
+    }
+    CachedChunk *cached = chunk_cache_oldest(cache);
+    cached_chunk_free(cached);
+    *cached = cache->entries[--cache->count];
+    return 1;
+}
+
+void chunk_cache_usage(Model *model, size_t *ram, size_t *vram)
+{
+    ChunkCache *cache = &model->chunk_cache;
+    *ram = 0;
+    *vram = 0;
+    for (int i = 0; i < cache->count; i++)
+    {
+        CachedChunk *cached = cache->entries + i;
+        *ram += map_bytes(&cached->map) + map_bytes(&cached->lights);
+        *ram += cached->signs.capacity * sizeof(Sign);
+        if (cached->buffer)
+        {
+            *vram += cached->faces * 6 * 10 * sizeof(GLfloat);
+        }
+        if (cached->sign_buffer)
+        {
+            *vram += cached->sign_faces * 6 * 5 * sizeof(GLfloat);
+        }
+    }
+}
+
+void chunk_cache_clear(Model *model)
+{
+    ChunkCache *cache = &model->chunk_cache;
+    for (int i = 0; i < cache->count; i++)
+    {
+        cached_chunk_free(cache->entries + i);
+    }
+    cache->count = 0;
+}
+
+void chunk_release(Chunk *chunk, Model *model)
+{
+    // the last live chunk takes over this one's place in the list
+    Chunk *last = model->chunks[--model->chunk_count];
+    model->chunks[chunk->order] = last;
+    last->order = chunk->order;
+    model->chunk_hot.used[last->order] =
+        model->chunk_hot.used[model->chunk_count];
+    chunk_hot_update(last, model);
+    chunk->generation++;
+    model->chunk_free[model->chunk_free_count++] = chunk->slot;
+}
+
+void chunk_queue_push(int p, int q, Model *model)
+{
+    ChunkQueue *queue = &model->chunk_queue;
+    int r = queue->radius;
+    int dp = p - queue->p;
+    int dq = q - queue->q;
+    if (!queue->valid || ABS(dp) > r || ABS(dq) > r)
+    {
+        return;
+    }
+    int score = queue->scores[(dp + r) * (2 * r + 1) + dq + r];
+    Chunk *chunk = find_chunk(p, q, model);
+    ChunkHeap *heap = chunk ? &queue->mesh : &queue->load;
+    if (chunk && chunk->buffer && chunk->dirty)
+    {
+        // remeshing a chunk that is already drawn can wait
+        score |= 1 << 16;
+    }
+    if (heap->size == heap->capacity)
+    {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+        heap->jobs = (ChunkJob *)realloc(
+            heap->jobs, sizeof(ChunkJob) * heap->capacity);
+    }
+    int i = heap->size++;
+    while (i)
+    {
+        int parent = (i - 1) / 2;
+        if (heap->jobs[parent].score <= score)
+        {
+            break;
+        }
+        heap->jobs[i] = heap->jobs[parent];
+        i = parent;
+    }
+    heap->jobs[i].p = p;
+    heap->jobs[i].q = q;
+    heap->jobs[i].score = score;
+}
+
+int chunk_heap_pop(ChunkHeap *heap, int *p, int *q)
+{
+    if (!heap->size)
+    {
+        return 0;
+    }
+    *p = heap->jobs[0].p;
+    *q = heap->jobs[0].q;
+    ChunkJob last = heap->jobs[--heap->size];
+    int i = 0;
+    while (1)
+    {
+        int child = i * 2 + 1;
+        if (child >= heap->size)
+        {
+            break;
+        }
+        if (child + 1 < heap->size &&
+            heap->jobs[child + 1].score < heap->jobs[child].score)
+        {
+            child++;
+        }
+        if (last.score <= heap->jobs[child].score)
+        {
+            break;
+        }
+        heap->jobs[i] = heap->jobs[child];
+        i = child;
+    }
+    heap->jobs[i] = last;
+    return 1;
+}
+
+void chunk_queue_clear(Model *model)
+{
+    model->chunk_queue.load.size = 0;
+    model->chunk_queue.mesh.size = 0;
+    model->chunk_queue.valid = 0;
+}
+
+void chunk_table_clear(Model *model)
+{
+    chunk_queue_clear(model);
+    model->held_count = 0;
+    while (model->chunk_count)
+    {
+        chunk_release(model->chunks[model->chunk_count - 1], model);
+    }
+    if (model->chunk_index)
+    {
+        memset(
+            model->chunk_index, 0,
+            sizeof(int) * (model->chunk_index_mask + 1));
+    }
+}
+
+void chunk_table_free(Model *model)
+{
+    for (int i = 0; i < model->chunk_capacity / CHUNK_PAGE_SIZE; i++)
+    {
+        free(model->chunk_pages[i]);
+    }
+    free(model->chunk_pages);
+    free(model->chunks);
+    free(model->chunk_free);
+    free(model->chunk_index);
+    ChunkHot *hot = &model->chunk_hot;
+    free(hot->p);
+    free(hot->q);
+    free(hot->miny);
+    free(hot->maxy);
+    free(hot->faces);
+    free(hot->sign_faces);
+    free(hot->buffer);
+    free(hot->sign_buffer);
+    free(hot->ram);
+    free(hot->vram);
+    free(hot->used);
+    memset(hot, 0, sizeof(ChunkHot));
+    free(model->chunk_queue.load.jobs);
+    free(model->chunk_queue.mesh.jobs);
+    free(model->chunk_queue.scores);
+    memset(&model->chunk_queue, 0, sizeof(ChunkQueue));
+    free(model->held_chunks);
+    model->chunk_pages = 0;
+    model->chunks = 0;
+    model->chunk_free = 0;
+    model->chunk_index = 0;
+    model->chunk_index_mask = 0;
+    model->chunk_count = 0;
+    model->chunk_capacity = 0;
+    model->chunk_free_count = 0;
+    model->held_chunks = 0;
+    model->held_count = 0;
+    model->held_capacity = 0;
+}
+
+ChunkHandle chunk_handle(Chunk *chunk)
+{
+    ChunkHandle handle;
+    handle.slot = chunk->slot;
+    handle.generation = chunk->generation;
+    return handle;
+}
+
+Chunk *chunk_from_handle(ChunkHandle handle, Model *model)
+{
+    if (handle.slot < 0 || handle.slot >= model->chunk_capacity)
+    {
+        return 0;
+    }
+    Chunk *chunk = CHUNK_AT(model, handle.slot);
+    if (chunk->generation != handle.generation)
+    {
+        return 0;
+    }
+    return chunk;
+}
+
+Chunk *find_chunk(int p, int q, Model *model)
+{
+    int index = chunk_index_find(p, q, model);
+    if (index < 0)
+    {
+        return 0;
+    }
+    return CHUNK_AT(model, model->chunk_index[index] - 1);
+}
+
+void chunk_link(Chunk *chunk, Model *model)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        for (int b = 0; b < 3; b++)
+        {
+            Chunk *other = chunk;
+            if (a != 1 || b != 1)
+            {
+                other = find_chunk(chunk->p + a - 1, chunk->q + b - 1, model);
+            }
+            chunk->neighbors[a][b] = other;
+            if (other)
+            {
+                other->neighbors[2 - a][2 - b] = chunk;
+            }
+        }
+    }
+}
+
+void chunk_unlink(Chunk *chunk)
+{
+    NEIGHBORHOOD_FOR_EACH(chunk, other, a, b)
+    {
+        other->neighbors[2 - a][2 - b] = 0;
+    }
+    END_NEIGHBORHOOD_FOR_EACH;
+}
+
 int chunk_distance(Chunk *chunk, int p, int q)
 {
     int dp = ABS(chunk->p - p);
@@ -34,44 +560,105 @@ int has_lights(Chunk *chunk, Model *model)
     {
         return 0;
     }
-    for (int dp = -1; dp <= 1; dp++)
+    NEIGHBORHOOD_FOR_EACH(chunk, other, a, b)
     {
-        for (int dq = -1; dq <= 1; dq++)
+        Map *map = &other->lights;
+        if (map->size || other->packed_lights.size)
         {
-            Chunk *other = chunk;
-            if (dp || dq)
-            {
-                other = find_chunk(chunk->p + dp, chunk->q + dq, model);
-            }
-            if (!other)
-            {
-                continue;
-            }
-            Map *map = &other->lights;
-            if (map->size)
-            {
-                return 1;
-            }
+            return 1;
         }
     }
+    END_NEIGHBORHOOD_FOR_EACH;
     return 0;
 }
 
-void dirty_chunk(Chunk *chunk, Model *model)
+void set_chunk_dirty(Chunk *chunk, Model *model)
 {
+    // a busy chunk is queued again when its worker is done
+    if (!chunk->dirty && !chunk->busy)
+    {
+        chunk_queue_push(chunk->p, chunk->q, model);
+    }
     chunk->dirty = 1;
+    chunk->edits++;
+}
+
+void dirty_chunk(Chunk *chunk, Model *model)
+{
+    set_chunk_dirty(chunk, model);
     if (has_lights(chunk, model))
     {
-        for (int dp = -1; dp <= 1; dp++)
+        NEIGHBORHOOD_FOR_EACH(chunk, other, a, b)
         {
-            for (int dq = -1; dq <= 1; dq++)
+            set_chunk_dirty(other, model);
+        }
+        END_NEIGHBORHOOD_FOR_EACH;
+    }
+}
+
+void wake_waiting_neighbors(Chunk *chunk, Model *model)
+{
+    // they were dropped from the mesh heap by defer_mesh, and stay dirty
+    NEIGHBORHOOD_FOR_EACH(chunk, other, a, b)
+    {
+        if (other != chunk && other->dirty && !other->busy && other->loaded)
+        {
+            chunk_queue_push(other->p, other->q, model);
+        }
+    }
+    END_NEIGHBORHOOD_FOR_EACH;
+}
+
+int light_reach(Chunk *chunk, int x, int y, int z, Model *model)
+{
+    if (!SHOW_LIGHTS)
+    {
+        return 0;
+    }
+    int result = 0;
+    NEIGHBORHOOD_FOR_EACH(chunk, other, a, b)
+    {
+        if (other->packed)
+        {
+            // not worth unpacking, assume a full strength light is close
+            if (other->packed_lights.size)
             {
-                Chunk *other = find_chunk(chunk->p + dp, chunk->q + dq, model);
-                if (other)
-                {
-                    other->dirty = 1;
-                }
+                result = MAX(result, 15);
             }
+            continue;
+        }
+        Map *map = &other->lights;
+        MAP_FOR_EACH(map, ex, ey, ez, ew)
+        {
+            int distance = ABS(ex - x) + ABS(ey - y) + ABS(ez - z);
+            result = MAX(result, ew - distance);
+        }
+        END_MAP_FOR_EACH;
+    }
+    END_NEIGHBORHOOD_FOR_EACH;
+    return result;
+}
+
+void dirty_chunk_near(Chunk *chunk, int x, int z, int reach, Model *model)
+{
+    set_chunk_dirty(chunk, model);
+    if (reach <= 0)
+    {
+        return;
+    }
+    NEIGHBORHOOD_FOR_EACH(chunk, other, a, b)
+    {
+        int x1 = other->p * CHUNK_SIZE;
+        int z1 = other->q * CHUNK_SIZE;
+        int x2 = x1 + CHUNK_SIZE - 1;
+        int z2 = z1 + CHUNK_SIZE - 1;
+        int dx = MAX(0, MAX(x1 - x, x - x2));
+        int dz = MAX(0, MAX(z1 - z, z - z2));
+        // one block of slack for faces that sample the light next to them
+        if (dx + dz <= reach + 1)
+        {
+            set_chunk_dirty(other, model);
         }
     }
+    END_NEIGHBORHOOD_FOR_EACH;
 }
@@ -6,6 +6,19 @@
 /// [issue](https://github.com/WSU-CEG-6110-4410/Remainders-Craft/issues/8)
 /// [issue](https://github.com/WSU-CEG-6110-4410/Remainders-Craft/issues/22)
 
+/// Iterates over the loaded chunks of the 3x3 neighborhood of a
+/// chunk, including the chunk itself. a and b are the neighbor's
+/// indices into neighbors, i.e. dp + 1 and dq + 1.
+#define NEIGHBORHOOD_FOR_EACH(chunk, other, a, b) \
+    for (int a = 0; a < 3; a++) \
+    for (int b = 0; b < 3; b++) { \
+        Chunk *other = (chunk)->neighbors[a][b]; \
+        if (!other) { \
+            continue; \
+        }
+
+#define END_NEIGHBORHOOD_FOR_EACH }
+
 /// Call this function to translate a float coordinate to a
 /// int chunk coordinate which can be used to locate a
 /// chunk.
@@ -21,6 +34,149 @@ int chunked(float x);
 /// otherwise 0 is returned.
 Chunk *find_chunk(int p, int q, Model *model);
 
+/// Call this function to add a chunk to the (p, q) index used by
+/// find_chunk. The chunk's p and q must already be set.
+///\param[in] chunk: The chunk to add.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_index_insert(Chunk *chunk, Model *model);
+
+/// Call this function to remove a chunk from the (p, q) index
+/// before its slot is freed or reused.
+///\param[in] chunk: The chunk to remove.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_index_remove(Chunk *chunk, Model *model);
+
+/// Call this function to take a free slot in the chunk table,
+/// growing the table if every slot is in use. The chunk is added to
+/// the list of live chunks but is otherwise uninitialized.
+///\param[in,out] model: The Model pointer used by the game instance.
+///\param[out] Chunk: The chunk, whose address stays valid until it
+/// is released.
+Chunk *chunk_alloc(Model *model);
+
+/// Call this function after changing a chunk's position, bounds,
+/// face counts or buffers, to copy them into model->chunk_hot.
+///\param[in] chunk: The chunk that changed.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_hot_update(Chunk *chunk, Model *model);
+
+/// Call this function to move a chunk's blocks and lights into their
+/// packed form, freeing its maps. The chunk must not be busy.
+///\param[in,out] chunk: The chunk to pack.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_pack(Chunk *chunk, Model *model);
+
+/// Call this function before touching a chunk's map or lights, to
+/// restore them if the chunk has been packed.
+///\param[in,out] chunk: The chunk whose maps are needed.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_unpack(Chunk *chunk, Model *model);
+
+/// Call this function when a chunk is deleted, to move its blocks,
+/// lights, signs and GL buffers into model->chunk_cache. Busy and packed
+/// chunks are not cached.
+///\param[in] chunk: The chunk that is being deleted.
+///\param[in,out] model: The Model pointer used by the game instance.
+///\param[out] int: 1 if the chunk's contents were taken, 0 if they
+/// still need to be freed.
+int chunk_cache_put(Chunk *chunk, Model *model);
+
+/// Call this function to look up a deleted chunk in model->chunk_cache.
+///\param[in] p: The x chunk coordinate.
+///\param[in] q: The z chunk coordinate.
+///\param[in] model: The Model pointer used by the game instance.
+///\param[out] CachedChunk: The cached contents, or 0 if there are none.
+CachedChunk *chunk_cache_find(int p, int q, Model *model);
+
+/// Call this function to move cached contents into a new chunk and
+/// drop them from the cache.
+///\param[out] chunk: The chunk to fill in.
+///\param[in] cached: An entry from chunk_cache_find.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_cache_take(Chunk *chunk, CachedChunk *cached, Model *model);
+
+/// Call this function when a chunk that is not loaded is edited, so
+/// that stale cached contents are not brought back.
+///\param[in] p: The x chunk coordinate.
+///\param[in] q: The z chunk coordinate.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_cache_drop(int p, int q, Model *model);
+
+/// Call this function to free the entry of model->chunk_cache that was
+/// deleted longest ago.
+///\param[in,out] model: The Model pointer used by the game instance.
+///\param[out] int: 1 if an entry was freed, 0 if the cache is empty.
+int chunk_cache_evict(Model *model);
+
+/// Call this function to add up the memory held by model->chunk_cache.
+///\param[in] model: The Model pointer used by the game instance.
+///\param[out] ram: Bytes of block, light and sign data.
+///\param[out] vram: Bytes of GL buffers.
+void chunk_cache_usage(Model *model, size_t *ram, size_t *vram);
+
+/// Call this function to free every entry of model->chunk_cache.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_cache_clear(Model *model);
+
+/// Call this function to queue a chunk for loading, if it does not
+/// exist yet, or else for meshing. The chunk is ignored if it is outside
+/// the radius the queue was built for.
+///\param[in] p: The x chunk coordinate.
+///\param[in] q: The z chunk coordinate.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_queue_push(int p, int q, Model *model);
+
+/// Call this function to take the best scored job off one of the heaps
+/// of the chunk queue.
+///\param[in,out] heap: The load or mesh heap of model->chunk_queue.
+///\param[out] p: The x chunk coordinate of the job.
+///\param[out] q: The z chunk coordinate of the job.
+///\param[out] int: 1 if a job was taken, 0 if the heap is empty.
+int chunk_heap_pop(ChunkHeap *heap, int *p, int *q);
+
+/// Call this function to drop every queued job and mark the queue as
+/// needing a rebuild.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_queue_clear(Model *model);
+
+/// Call this function to return a chunk's slot to the chunk table.
+/// Handles to the chunk stop resolving.
+///\param[in] chunk: The chunk to release.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_release(Chunk *chunk, Model *model);
+
+/// Call this function to release every chunk and empty the (p, q)
+/// index. The table keeps its memory for reuse.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_table_clear(Model *model);
+
+/// Call this function to free the memory of the chunk table.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_table_free(Model *model);
+
+/// Call this function to get a handle that can be resolved to the
+/// chunk later with chunk_from_handle.
+///\param[in] chunk: The chunk to refer to.
+///\param[out] ChunkHandle: The handle.
+ChunkHandle chunk_handle(Chunk *chunk);
+
+/// Call this function to resolve a handle.
+///\param[in] handle: A handle from chunk_handle.
+///\param[in] model: The Model pointer used by the game instance.
+///\param[out] Chunk: The chunk, or 0 if it has been deleted since.
+Chunk *chunk_from_handle(ChunkHandle handle, Model *model);
+
+/// Call this function to link a newly created chunk with its
+/// loaded neighbors, in both directions.
+///\param[in,out] chunk: The chunk to link.
+///\param[in,out] model: The Model pointer used by the game instance.
+void chunk_link(Chunk *chunk, Model *model);
+
+/// Call this function before a chunk is deleted so that its
+/// neighbors stop linking to it.
+///\param[in] chunk: The chunk that is being deleted.
+void chunk_unlink(Chunk *chunk);
+
 /// This function gives the distance between a
 /// chunk and a set of chunk coordinates.
 ///\param[in] chunk: The reference chunk.
@@ -38,7 +194,41 @@ int chunk_distance(Chunk *chunk, int p, int q);
 /// the other chunks in the game.
 ///\param[out] int: 1 indicates the chunk should have light, 0
 /// indicates that it should not.
-int has_lights(Chunk *chunk);
+int has_lights(Chunk *chunk, Model *model);
+
+/// Use this function to set the dirty flag for a single Chunk and
+/// queue it to be meshed again, without touching its neighbors.
+///\param[in] chunk: The chunk to be set as dirty.
+///\param[in,out] model: The game instance containing the chunk queue.
+void set_chunk_dirty(Chunk *chunk, Model *model);
+
+/// Use this function once a chunk's blocks and lights have arrived, by
+/// loading, by reviving it from the cache or by creating it on the spot,
+/// to queue the dirty neighbors whose meshing was put off until then.
+///\param[in] chunk: The chunk that arrived.
+///\param[in,out] model: The game instance containing the chunk queue.
+void wake_waiting_neighbors(Chunk *chunk, Model *model);
+
+/// Use this function to find how far light can carry a change at
+/// (x, y, z): the brightness the strongest light in the chunk's
+/// neighborhood still has there, or 0 if no light reaches it.
+///\param[in] chunk: The chunk that holds (x, y, z).
+///\param[in] x: The x block coordinate.
+///\param[in] y: The y block coordinate.
+///\param[in] z: The z block coordinate.
+///\param[in] model: The game instance containing all chunks.
+///\param[out] int: The number of blocks light carries the change.
+int light_reach(Chunk *chunk, int x, int y, int z, Model *model);
+
+/// Use this function after a block or light at (x, z) in a chunk has
+/// changed. The chunk is set dirty, and so are the neighbors that come
+/// within reach blocks of (x, z), since their light may change too.
+///\param[in] chunk: The chunk that holds (x, z).
+///\param[in] x: The x block coordinate.
+///\param[in] z: The z block coordinate.
+///\param[in] reach: How far the change carries, e.g. from light_reach.
+///\param[in,out] model: The game instance containing all chunks.
+void dirty_chunk_near(Chunk *chunk, int x, int z, int reach, Model *model);
 
 /// Use this function to set the dirty flag for a Chunk, which
 /// indicates that the Chunck should stay rendered for the player.
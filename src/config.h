@@ -23,6 +23,7 @@
 #define SHOW_CROSSHAIRS 1
 #define SHOW_WIREFRAME 1
 #define SHOW_INFO_TEXT 1
+#define SHOW_CHUNK_STATS 0
 #define SHOW_CHAT_TEXT 1
 #define SHOW_PLAYER_NAMES 1
 
@@ -52,8 +53,27 @@ param[in] CRAFT_KEY_CROUCH: Crouch is assigned to the v key
 #define RENDER_CHUNK_RADIUS 10
 #define RENDER_SIGN_RADIUS 4
 #define DELETE_CHUNK_RADIUS 14
+#define REQUEUE_ANGLE 15
+#define PREFETCH_TIME 3
+// blocks per second, twice the flying speed; faster moves are teleports
+#define MAX_TRAVEL_SPEED 40
+#define CHUNK_CACHE_SIZE 64
+// chunks dirtied faster than EDIT_STORM_RATE times a second are meshed
+// at most once every REMESH_INTERVAL seconds
+#define EDIT_STORM_RATE 20
+#define REMESH_INTERVAL 0.5
+// chunks near the player are meshed in up to this many slabs at once
+#define MESH_SLABS 4
 #define CHUNK_SIZE 32
+#define WORLD_HEIGHT 256
+#define SECTION_HEIGHT 16
 #define COMMIT_INTERVAL 5
+// chunk memory budgets in megabytes, 0 for an eighth of physical memory
+#define RAM_BUDGET 0
+#define VRAM_BUDGET 512
+// once over a budget, chunks are demoted until usage is below this
+// fraction of it, so that demotion does not run again every frame
+#define RESIDENCY_LOW_WATER 0.75
 
 #define MODE_OFFLINE 0
 #define MODE_ONLINE 1
@@ -14,6 +14,8 @@ static sqlite3_stmt *delete_sign_stmt;
 static sqlite3_stmt *delete_signs_stmt;
 static sqlite3_stmt *load_blocks_stmt;
 static sqlite3_stmt *load_lights_stmt;
+static sqlite3_stmt *count_blocks_stmt;
+static sqlite3_stmt *count_lights_stmt;
 static sqlite3_stmt *load_signs_stmt;
 static sqlite3_stmt *get_key_stmt;
 static sqlite3_stmt *set_key_stmt;
@@ -105,9 +107,17 @@ int db_init(char *path) {
     static const char *delete_signs_query =
         "delete from sign where x = ? and y = ? and z = ?;";
     static const char *load_blocks_query =
-        "select x, y, z, w from block where p = ? and q = ?;";
+        "select x, y, z, w from block where p = ? and q = ? "
+        "and x between ? and ? and y between ? and ? and z between ? and ?;";
     static const char *load_lights_query =
-        "select x, y, z, w from light where p = ? and q = ?;";
+        "select x, y, z, w from light where p = ? and q = ? "
+        "and x between ? and ? and y between ? and ? and z between ? and ?;";
+    static const char *count_blocks_query =
+        "select count(*) from block where p = ? and q = ? "
+        "and x between ? and ? and y between ? and ? and z between ? and ?;";
+    static const char *count_lights_query =
+        "select count(*) from light where p = ? and q = ? "
+        "and x between ? and ? and y between ? and ? and z between ? and ?;";
     static const char *load_signs_query =
         "select x, y, z, face, text from sign where p = ? and q = ?;";
     static const char *get_key_query =
@@ -139,6 +149,12 @@ int db_init(char *path) {
     if (rc) return rc;
     rc = sqlite3_prepare_v2(db, load_lights_query, -1, &load_lights_stmt, NULL);
     if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        db, count_blocks_query, -1, &count_blocks_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        db, count_lights_query, -1, &count_lights_stmt, NULL);
+    if (rc) return rc;
     rc = sqlite3_prepare_v2(db, load_signs_query, -1, &load_signs_stmt, NULL);
     if (rc) return rc;
     rc = sqlite3_prepare_v2(db, get_key_query, -1, &get_key_stmt, NULL);
@@ -163,6 +179,8 @@ void db_close() {
     sqlite3_finalize(delete_signs_stmt);
     sqlite3_finalize(load_blocks_stmt);
     sqlite3_finalize(load_lights_stmt);
+    sqlite3_finalize(count_blocks_stmt);
+    sqlite3_finalize(count_lights_stmt);
     sqlite3_finalize(load_signs_stmt);
     sqlite3_finalize(get_key_stmt);
     sqlite3_finalize(set_key_stmt);
@@ -401,21 +419,46 @@ void db_delete_all_signs() {
     sqlite3_exec(db, "delete from sign;", NULL, NULL, NULL);
 }
 
+static void db_bind_map(sqlite3_stmt *stmt, Map *map, int p, int q) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p);
+    sqlite3_bind_int(stmt, 2, q);
+    sqlite3_bind_int(stmt, 3, map->dx);
+    sqlite3_bind_int(stmt, 4, map->dx + MAP_WIDTH - 1);
+    sqlite3_bind_int(stmt, 5, map->dy);
+    sqlite3_bind_int(stmt, 6, map->dy + MAP_HEIGHT - 1);
+    sqlite3_bind_int(stmt, 7, map->dz);
+    sqlite3_bind_int(stmt, 8, map->dz + MAP_WIDTH - 1);
+}
+
+static void db_load_map(
+    sqlite3_stmt *count_stmt, sqlite3_stmt *load_stmt, Map *map, int p, int q)
+{
+    // size the table for every row up front so the load never rehashes
+    db_bind_map(count_stmt, map, p, q);
+    if (sqlite3_step(count_stmt) == SQLITE_ROW) {
+        map_reserve(map, map->size + sqlite3_column_int(count_stmt, 0));
+    }
+    // a stepped statement keeps its read transaction open until reset,
+    // which would hold up commits from the writer thread
+    sqlite3_reset(count_stmt);
+    // rows outside the map are filtered by the query, not per row here
+    db_bind_map(load_stmt, map, p, q);
+    while (sqlite3_step(load_stmt) == SQLITE_ROW) {
+        int x = sqlite3_column_int(load_stmt, 0);
+        int y = sqlite3_column_int(load_stmt, 1);
+        int z = sqlite3_column_int(load_stmt, 2);
+        int w = sqlite3_column_int(load_stmt, 3);
+        map_put(map, x, y, z, w);
+    }
+}
+
 void db_load_blocks(Map *map, int p, int q) {
     if (!db_enabled) {
         return;
     }
     mtx_lock(&load_mtx);
-    sqlite3_reset(load_blocks_stmt);
-    sqlite3_bind_int(load_blocks_stmt, 1, p);
-    sqlite3_bind_int(load_blocks_stmt, 2, q);
-    while (sqlite3_step(load_blocks_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_blocks_stmt, 0);
-        int y = sqlite3_column_int(load_blocks_stmt, 1);
-        int z = sqlite3_column_int(load_blocks_stmt, 2);
-        int w = sqlite3_column_int(load_blocks_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
+    db_load_map(count_blocks_stmt, load_blocks_stmt, map, p, q);
     mtx_unlock(&load_mtx);
 }
 
@@ -424,16 +467,7 @@ void db_load_lights(Map *map, int p, int q) {
         return;
     }
     mtx_lock(&load_mtx);
-    sqlite3_reset(load_lights_stmt);
-    sqlite3_bind_int(load_lights_stmt, 1, p);
-    sqlite3_bind_int(load_lights_stmt, 2, q);
-    while (sqlite3_step(load_lights_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_lights_stmt, 0);
-        int y = sqlite3_column_int(load_lights_stmt, 1);
-        int z = sqlite3_column_int(load_lights_stmt, 2);
-        int w = sqlite3_column_int(load_lights_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
+    db_load_map(count_lights_stmt, load_lights_stmt, map, p, q);
     mtx_unlock(&load_mtx);
 }
 
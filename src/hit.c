@@ -68,13 +68,15 @@ int hit_test(
     int q = chunked(z);
     float vx, vy, vz;
     get_sight_vector(rx, ry, &vx, &vy, &vz);
+    ChunkHot *hot = &model->chunk_hot;
     for (int i = 0; i < model->chunk_count; i++)
     {
-        Chunk *chunk = model->chunks + i;
-        if (chunk_distance(chunk, p, q) > 1)
+        if (ABS(hot->p[i] - p) > 1 || ABS(hot->q[i] - q) > 1)
         {
             continue;
         }
+        Chunk *chunk = model->chunks[i];
+        chunk_unpack(chunk, model);
         int hx, hy, hz;
         int hw = _hit_test(&chunk->map, 8, previous,
                            x, y, z, vx, vy, vz, &hx, &hy, &hz);
@@ -59,7 +59,7 @@ void on_left_click(Model *model)
     State *s = &model->players->state;
     int hx, hy, hz;
     int hw = hit_test(0, s->x, s->y, s->z, s->rx, s->ry, &hx, &hy, &hz, model);
-    if (hy > 0 && hy < 256 && is_destructable(hw))
+    if (hy > 0 && hy < WORLD_HEIGHT && is_destructable(hw))
     {
         set_block(hx, hy, hz, 0, model);
         record_block(hx, hy, hz, 0, model);
@@ -75,7 +75,7 @@ void on_right_click(Model *model)
     State *s = &model->players->state;
     int hx, hy, hz;
     int hw = hit_test(1, s->x, s->y, s->z, s->rx, s->ry, &hx, &hy, &hz, model);
-    if (hy > 0 && hy < 256 && is_obstacle(hw))
+    if (hy > 0 && hy < WORLD_HEIGHT && is_obstacle(hw))
     {
         if (!player_intersects_block(2, s->x, s->y, s->z, hx, hy, hz))
         {
@@ -107,12 +107,14 @@ void toggle_light(int x, int y, int z, Model *model)
     Chunk *chunk = find_chunk(p, q, model);
     if (chunk)
     {
+        chunk_unpack(chunk, model);
         Map *map = &chunk->lights;
         int w = map_get(map, x, y, z) ? 0 : 15;
         map_set(map, x, y, z, w);
+        chunk_hot_update(chunk, model);
         db_insert_light(p, q, x, y, z, w);
         client_light(x, y, z, w);
-        dirty_chunk(chunk, model);
+        dirty_chunk_near(chunk, x, z, 15, model);
     }
 }
 
@@ -121,7 +123,7 @@ void on_light(Model *model)
     State *s = &model->players->state;
     int hx, hy, hz;
     int hw = hit_test(0, s->x, s->y, s->z, s->rx, s->ry, &hx, &hy, &hz, model);
-    if (hy > 0 && hy < 256 && is_destructable(hw))
+    if (hy > 0 && hy < WORLD_HEIGHT && is_destructable(hw))
     {
         toggle_light(hx, hy, hz, model);
     }
@@ -15,6 +15,7 @@
 #include "map.h"
 #include "matrix.h"
 #include "noise.h"
+#include "scheduler.h"
 #include "sign.h"
 #include "tinycthread.h"
 #include "util.h"
@@ -24,9 +25,7 @@
 #include "block.h"
 #include "hit.h"
 
-#define MAX_CHUNKS 8192
 #define MAX_PLAYERS 128
-#define WORKERS 4
 #define MAX_TEXT_LENGTH 256
 #define MAX_NAME_LENGTH 32
 #define MAX_PATH_LENGTH 256
@@ -36,10 +35,6 @@
 #define ALIGN_CENTER 1
 #define ALIGN_RIGHT 2
 
-#define WORKER_IDLE 0
-#define WORKER_BUSY 1
-#define WORKER_DONE 2
-
 static Model model;
 static Model *g = &model;
 
@@ -326,11 +321,12 @@ void draw_lines(Attrib *attrib, GLuint buffer, int components, int count)
 /**
 Draws a world chunk that displays the world.
 \param[in] attrib: Attrib struct that contains information on what will be drawn.
-\param[in] chunk: Pointer to the specific chunk that will be drawn.
+\param[in] buffer: Buffer that holds the geometry of the chunk.
+\param[in] faces: How many faces the chunk has.
 */
-void draw_chunk(Attrib *attrib, Chunk *chunk)
+void draw_chunk(Attrib *attrib, GLuint buffer, int faces)
 {
-    draw_triangles_3d_ao(attrib, chunk->buffer, chunk->faces * 6);
+    draw_triangles_3d_ao(attrib, buffer, faces * 6);
 }
 
 /**
@@ -361,13 +357,14 @@ void draw_text(Attrib *attrib, GLuint buffer, int length)
 /**
 Draws signs that will be present in the chunk.
 \param[in] attrib: Attrib struct that contains information on what will be drawn.
-\param[in] chunk: Pointer to the specific chunk that will be drawn.
+\param[in] buffer: Buffer that holds the sign geometry of the chunk.
+\param[in] faces: How many faces the signs of the chunk have.
 */
-void draw_signs(Attrib *attrib, Chunk *chunk)
+void draw_signs(Attrib *attrib, GLuint buffer, int faces)
 {
     glEnable(GL_POLYGON_OFFSET_FILL);
     glPolygonOffset(-8, -1024);
-    draw_triangles_3d_text(attrib, chunk->sign_buffer, chunk->sign_faces * 6);
+    draw_triangles_3d_text(attrib, buffer, faces * 6);
     glDisable(GL_POLYGON_OFFSET_FILL);
 }
 
@@ -769,6 +766,7 @@ void gen_sign_buffer(Chunk *chunk)
     del_buffer(chunk->sign_buffer);
     chunk->sign_buffer = gen_faces(5, faces, data);
     chunk->sign_faces = faces;
+    chunk_hot_update(chunk, g);
 }
 
 /**
@@ -825,17 +823,25 @@ void occlusion(
     }
 }
 
+#if CHUNK_SIZE + 2 > MAP_WIDTH
+    #error "chunk maps are limited to MAP_WIDTH columns"
+#endif
+
 #define XZ_SIZE (CHUNK_SIZE * 3 + 2)
 #define XZ_LO (CHUNK_SIZE)
 #define XZ_HI (CHUNK_SIZE * 2 + 1)
-#define Y_SIZE 258
-#define XYZ(x, y, z) ((y)*XZ_SIZE * XZ_SIZE + (x)*XZ_SIZE + (z))
-#define XZ(x, z) ((x)*XZ_SIZE + (z))
+#define RIM_SIZE (CHUNK_SIZE + 2)
+#define Y_SIZE (WORLD_HEIGHT + 2)
+#define XYZ_N(n, x, y, z) ((y) * (n) * (n) + (x) * (n) + (z))
+#define XZ_N(n, x, z) ((x) * (n) + (z))
+#define XYZ(x, y, z) XYZ_N(XZ_SIZE, x, y, z)
+#define XZ(x, z) XZ_N(XZ_SIZE, x, z)
 
 /**
 Generates light for the world
 \param[in] opaque: Used to determine if an object is opaque or not.
 \param[in] light: Array for the light values in the world.
+\param[in] height: Number of rows in the working volume; light does not spread above them.
 \param[in] x: x for determining light generation location.
 \param[in] y: y for determining light generation location.
 \param[in] z: z for determining light generation location.
@@ -843,7 +849,7 @@ Generates light for the world
 \param[in] force: Determines if light generation should be forced or not.
 */
 void light_fill(
-    char *opaque, char *light,
+    char *opaque, char *light, int height,
     int x, int y, int z, int w, int force)
 {
     if (x + w < XZ_LO || z + w < XZ_LO)
@@ -854,7 +860,7 @@ void light_fill(
     {
         return;
     }
-    if (y < 0 || y >= Y_SIZE)
+    if (y < 0 || y >= height)
     {
         return;
     }
@@ -867,126 +873,140 @@ void light_fill(
         return;
     }
     light[XYZ(x, y, z)] = w--;
-    light_fill(opaque, light, x - 1, y, z, w, 0);
-    light_fill(opaque, light, x + 1, y, z, w, 0);
-    light_fill(opaque, light, x, y - 1, z, w, 0);
-    light_fill(opaque, light, x, y + 1, z, w, 0);
-    light_fill(opaque, light, x, y, z - 1, w, 0);
-    light_fill(opaque, light, x, y, z + 1, w, 0);
-}
-
-/**
-Handles all the calculations for the generation of a chunk. Generates all of the data that goes into a chunk.
-\param[in] item: Struct that contains the data that will be used to calculate the data for the chunk.
-*/
-void compute_chunk(WorkerItem *item)
-{
-    char *opaque = (char *)calloc(XZ_SIZE * XZ_SIZE * Y_SIZE, sizeof(char));
-    char *light = (char *)calloc(XZ_SIZE * XZ_SIZE * Y_SIZE, sizeof(char));
-    char *highest = (char *)calloc(XZ_SIZE * XZ_SIZE, sizeof(char));
-
-    int ox = item->p * CHUNK_SIZE - CHUNK_SIZE - 1;
-    int oy = -1;
-    int oz = item->q * CHUNK_SIZE - CHUNK_SIZE - 1;
-
-    // check for lights
-    int has_light = 0;
-    if (SHOW_LIGHTS)
-    {
-        for (int a = 0; a < 3; a++)
-        {
-            for (int b = 0; b < 3; b++)
+    light_fill(opaque, light, height, x - 1, y, z, w, 0);
+    light_fill(opaque, light, height, x + 1, y, z, w, 0);
+    light_fill(opaque, light, height, x, y - 1, z, w, 0);
+    light_fill(opaque, light, height, x, y + 1, z, w, 0);
+    light_fill(opaque, light, height, x, y, z - 1, w, 0);
+    light_fill(opaque, light, height, x, y, z + 1, w, 0);
+}
+
+/**
+Copies the one block border that a neighboring chunk contributes to a compact working volume.
+\param[in] map: Block map of the neighboring chunk.
+\param[in] a: Position of the neighbor along x in the 3x3 neighborhood (0, 1 or 2).
+\param[in] b: Position of the neighbor along z in the 3x3 neighborhood (0, 1 or 2).
+\param[in] ox: World x coordinate of the working volume origin.
+\param[in] oz: World z coordinate of the working volume origin.
+\param[in] height: Number of rows in the working volume.
+\param[out] opaque: Working volume of RIM_SIZE x height x RIM_SIZE opacity values.
+\param[out] highest: Highest opaque y of each working volume column.
+\return The highest y that was marked opaque, or 0 if there was none.
+*/
+int extract_rim(
+    Map *map, int a, int b, int ox, int oz, int height,
+    char *opaque, short *highest)
+{
+    int n = RIM_SIZE;
+    int x0 = a == 0 ? 0 : (a == 1 ? 1 : n - 1);
+    int x1 = a == 0 ? 0 : (a == 1 ? n - 2 : n - 1);
+    int z0 = b == 0 ? 0 : (b == 1 ? 1 : n - 1);
+    int z1 = b == 0 ? 0 : (b == 1 ? n - 2 : n - 1);
+    int top = 0;
+    for (int x = x0; x <= x1; x++)
+    {
+        for (int z = z0; z <= z1; z++)
+        {
+            highest[XZ_N(n, x, z)] = 0;
+            for (int y = 1; y < height - 1; y++)
             {
-                Map *map = item->light_maps[a][b];
-                if (map && map->size)
-                {
-                    has_light = 1;
-                }
-            }
-        }
-    }
-
-    // populate opaque array
-    for (int a = 0; a < 3; a++)
-    {
-        for (int b = 0; b < 3; b++)
-        {
-            Map *map = item->block_maps[a][b];
-            if (!map)
-            {
-                continue;
-            }
-            MAP_FOR_EACH(map, ex, ey, ez, ew)
-            {
-                int x = ex - ox;
-                int y = ey - oy;
-                int z = ez - oz;
-                int w = ew;
-                // TODO: this should be unnecessary
-                if (x < 0 || y < 0 || z < 0)
+                // empty sections are air, which the zeroed scratch already
+                // holds, so skip to the last row of the section
+                int section = (y - 1 - map->dy) / SECTION_HEIGHT;
+                if (section >= 0 && section < MAP_SECTIONS &&
+                    MAP_SECTION_EMPTY(map, section))
                 {
+                    y = map->dy + (section + 1) * SECTION_HEIGHT;
                     continue;
                 }
-                if (x >= XZ_SIZE || y >= Y_SIZE || z >= XZ_SIZE)
+                int w = map_get(map, x + ox, y - 1, z + oz);
+                opaque[XYZ_N(n, x, y, z)] = !is_transparent(w);
+                if (opaque[XYZ_N(n, x, y, z)])
                 {
-                    continue;
-                }
-                // END TODO
-                opaque[XYZ(x, y, z)] = !is_transparent(w);
-                if (opaque[XYZ(x, y, z)])
-                {
-                    highest[XZ(x, z)] = MAX(highest[XZ(x, z)], y);
+                    highest[XZ_N(n, x, z)] = y;
+                    top = MAX(top, y);
                 }
             }
-            END_MAP_FOR_EACH;
         }
     }
+    return top;
+}
 
-    // flood fill light intensities
-    if (has_light)
+/**
+Frees the scratch buffers of a thread.
+\param[in,out] scratch: The scratch buffers to free.
+*/
+void scratch_free(Scratch *scratch)
+{
+    free(scratch->opaque);
+    free(scratch->light);
+    free(scratch->highest);
+    scratch->opaque = 0;
+    scratch->light = 0;
+    scratch->highest = 0;
+    scratch->n = 0;
+    scratch->size = 0;
+}
+
+/**
+Makes the scratch buffers large enough for a working volume n blocks wide and height rows tall. Most chunks have
+no lights nearby and only need RIM_SIZE, and the height follows the highest non-empty section rather than
+WORLD_HEIGHT, so the buffers start small and only grow when a larger volume is first needed.
+\param[in,out] scratch: The scratch buffers of the thread that is about to compute a chunk.
+\param[in] n: Width of the working volume, RIM_SIZE or XZ_SIZE.
+\param[in] height: Number of rows in the working volume, at most Y_SIZE.
+*/
+void scratch_alloc(Scratch *scratch, int n, int height)
+{
+    if (scratch->n >= n && scratch->size >= n * n * height)
     {
-        for (int a = 0; a < 3; a++)
-        {
-            for (int b = 0; b < 3; b++)
-            {
-                Map *map = item->light_maps[a][b];
-                if (!map)
-                {
-                    continue;
-                }
-                MAP_FOR_EACH(map, ex, ey, ez, ew)
-                {
-                    int x = ex - ox;
-                    int y = ey - oy;
-                    int z = ez - oz;
-                    light_fill(opaque, light, x, y, z, ew, 1);
-                }
-                END_MAP_FOR_EACH;
-            }
-        }
+        return;
     }
+    n = MAX(n, scratch->n);
+    int size = MAX(n * n * height, scratch->size);
+    scratch_free(scratch);
+    scratch->opaque = (char *)calloc(size, sizeof(char));
+    scratch->light = (char *)calloc(size, sizeof(char));
+    scratch->highest = (short *)calloc(n * n, sizeof(short));
+    scratch->n = n;
+    scratch->size = size;
+}
 
-    Map *map = item->block_maps[1][1];
+/**
+Generates the faces of the blocks in one vertical slab of a chunk, from the working volume
+that compute_chunk built.
+\param[in,out] slab: The slab to mesh. Its miny, maxy, faces and data are filled in.
+*/
+void mesh_slab(MeshSlab *slab)
+{
+    Map *map = slab->map;
+    char *opaque = slab->opaque;
+    char *light = slab->light;
+    short *highest = slab->highest;
+    int n = slab->n;
+    int ox = slab->ox;
+    int oy = slab->oy;
+    int oz = slab->oz;
 
     // count exposed faces
-    int miny = 256;
+    int miny = WORLD_HEIGHT;
     int maxy = 0;
     int faces = 0;
     MAP_FOR_EACH(map, ex, ey, ez, ew)
     {
-        if (ew <= 0)
+        if (ew <= 0 || ey < slab->y1 || ey >= slab->y2)
         {
             continue;
         }
         int x = ex - ox;
         int y = ey - oy;
         int z = ez - oz;
-        int f1 = !opaque[XYZ(x - 1, y, z)];
-        int f2 = !opaque[XYZ(x + 1, y, z)];
-        int f3 = !opaque[XYZ(x, y + 1, z)];
-        int f4 = !opaque[XYZ(x, y - 1, z)] && (ey > 0);
-        int f5 = !opaque[XYZ(x, y, z - 1)];
-        int f6 = !opaque[XYZ(x, y, z + 1)];
+        int f1 = !opaque[XYZ_N(n, x - 1, y, z)];
+        int f2 = !opaque[XYZ_N(n, x + 1, y, z)];
+        int f3 = !opaque[XYZ_N(n, x, y + 1, z)];
+        int f4 = !opaque[XYZ_N(n, x, y - 1, z)] && (ey > 0);
+        int f5 = !opaque[XYZ_N(n, x, y, z - 1)];
+        int f6 = !opaque[XYZ_N(n, x, y, z + 1)];
         int total = f1 + f2 + f3 + f4 + f5 + f6;
         if (total == 0)
         {
@@ -1007,19 +1027,19 @@ void compute_chunk(WorkerItem *item)
     int offset = 0;
     MAP_FOR_EACH(map, ex, ey, ez, ew)
     {
-        if (ew <= 0)
+        if (ew <= 0 || ey < slab->y1 || ey >= slab->y2)
         {
             continue;
         }
         int x = ex - ox;
         int y = ey - oy;
         int z = ez - oz;
-        int f1 = !opaque[XYZ(x - 1, y, z)];
-        int f2 = !opaque[XYZ(x + 1, y, z)];
-        int f3 = !opaque[XYZ(x, y + 1, z)];
-        int f4 = !opaque[XYZ(x, y - 1, z)] && (ey > 0);
-        int f5 = !opaque[XYZ(x, y, z - 1)];
-        int f6 = !opaque[XYZ(x, y, z + 1)];
+        int f1 = !opaque[XYZ_N(n, x - 1, y, z)];
+        int f2 = !opaque[XYZ_N(n, x + 1, y, z)];
+        int f3 = !opaque[XYZ_N(n, x, y + 1, z)];
+        int f4 = !opaque[XYZ_N(n, x, y - 1, z)] && (ey > 0);
+        int f5 = !opaque[XYZ_N(n, x, y, z - 1)];
+        int f6 = !opaque[XYZ_N(n, x, y, z + 1)];
         int total = f1 + f2 + f3 + f4 + f5 + f6;
         if (total == 0)
         {
@@ -1035,14 +1055,14 @@ void compute_chunk(WorkerItem *item)
             {
                 for (int dz = -1; dz <= 1; dz++)
                 {
-                    neighbors[index] = opaque[XYZ(x + dx, y + dy, z + dz)];
-                    lights[index] = light[XYZ(x + dx, y + dy, z + dz)];
+                    neighbors[index] = opaque[XYZ_N(n, x + dx, y + dy, z + dz)];
+                    lights[index] = light[XYZ_N(n, x + dx, y + dy, z + dz)];
                     shades[index] = 0;
-                    if (y + dy <= highest[XZ(x + dx, z + dz)])
+                    if (y + dy <= highest[XZ_N(n, x + dx, z + dz)])
                     {
                         for (int oy = 0; oy < 8; oy++)
                         {
-                            if (opaque[XYZ(x + dx, y + dy + oy, z + dz)])
+                            if (opaque[XYZ_N(n, x + dx, y + dy + oy, z + dz)])
                             {
                                 shades[index] = 1.0 - oy * 0.125;
                                 break;
@@ -1085,9 +1105,248 @@ void compute_chunk(WorkerItem *item)
     }
     END_MAP_FOR_EACH;
 
-    free(opaque);
-    free(light);
-    free(highest);
+
+    slab->miny = miny;
+    slab->maxy = maxy;
+    slab->faces = faces;
+    slab->data = data;
+}
+
+/**
+Meshes one of an array of slabs, for sched_parallel.
+\param[in,out] arg: The array of MeshSlabs.
+\param[in] index: The slab to mesh.
+*/
+void mesh_slab_at(void *arg, int index)
+{
+    mesh_slab((MeshSlab *)arg + index);
+}
+
+/**
+Splits the height of a chunk into slabs at section boundaries, so that each slab holds
+about the same number of blocks.
+\param[in] map: The block map of the chunk.
+\param[in] count: The most slabs to split into.
+\param[out] slabs: The slabs, whose y1 and y2 are set.
+\return Returns the number of slabs, at least one.
+*/
+int split_slabs(Map *map, int count, MeshSlab *slabs)
+{
+    int result = 0;
+    unsigned int sum = 0;
+    slabs[0].y1 = 0;
+    for (int i = 0; i < MAP_SECTIONS && result < count - 1; i++)
+    {
+        sum += map->sections[i];
+        if (sum * count >= map->size * (result + 1) && sum < map->size)
+        {
+            slabs[result].y2 = (i + 1) * SECTION_HEIGHT;
+            slabs[++result].y1 = (i + 1) * SECTION_HEIGHT;
+        }
+    }
+    slabs[result++].y2 = MAP_HEIGHT;
+    return result;
+}
+
+/**
+Handles all the calculations for the generation of a chunk. Generates all of the data that goes into a chunk.
+Without lights nearby only the chunk and a one block border of its neighbors is needed, so the working volume
+is RIM_SIZE wide. Lights can reach across neighboring chunks, so lit neighborhoods use the full 3x3 volume.
+The working volume lives in the scratch buffers of the calling thread, and only the layers that were written
+are cleared again before returning.
+\param[in] item: Struct that contains the data that will be used to calculate the data for the chunk.
+\param[in,out] scratch: Scratch buffers of the calling thread.
+*/
+void compute_chunk(WorkerItem *item, Scratch *scratch)
+{
+    // check for lights
+    int has_light = 0;
+    if (SHOW_LIGHTS)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            for (int b = 0; b < 3; b++)
+            {
+                Map *map = item->light_maps[a][b];
+                if (map && map->size)
+                {
+                    has_light = 1;
+                }
+            }
+        }
+    }
+
+    int n = has_light ? XZ_SIZE : RIM_SIZE;
+    int ox = item->p * CHUNK_SIZE - (n - CHUNK_SIZE) / 2;
+    int oy = -1;
+    int oz = item->q * CHUNK_SIZE - (n - CHUNK_SIZE) / 2;
+
+    // everything above the highest non-empty section of the neighborhood
+    // is air, so the working volume ends one row above it. that row lets
+    // faces on top be found, and light pass over the highest blocks
+    int height = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        for (int b = 0; b < 3; b++)
+        {
+            Map *map = item->block_maps[a][b];
+            if (map)
+            {
+                height = MAX(height, map_top(map) - oy + 1);
+            }
+            map = item->light_maps[a][b];
+            if (has_light && map)
+            {
+                height = MAX(height, map_top(map) - oy + 1);
+            }
+        }
+    }
+    height = MIN(MAX(height, 2), Y_SIZE);
+
+    scratch_alloc(scratch, n, height);
+    char *opaque = scratch->opaque;
+    char *light = scratch->light;
+    short *highest = scratch->highest;
+    int top = 0;
+    int light_lo = height;
+    int light_hi = -1;
+
+    // populate opaque array
+    for (int a = 0; a < 3; a++)
+    {
+        for (int b = 0; b < 3; b++)
+        {
+            Map *map = item->block_maps[a][b];
+            if (!map)
+            {
+                continue;
+            }
+            if (!has_light && (a != 1 || b != 1))
+            {
+                continue;
+            }
+            MAP_FOR_EACH(map, ex, ey, ez, ew)
+            {
+                int x = ex - ox;
+                int y = ey - oy;
+                int z = ez - oz;
+                int w = ew;
+                // TODO: this should be unnecessary
+                if (x < 0 || y < 0 || z < 0)
+                {
+                    continue;
+                }
+                if (x >= n || y >= height || z >= n)
+                {
+                    continue;
+                }
+                // END TODO
+                opaque[XYZ_N(n, x, y, z)] = !is_transparent(w);
+                if (opaque[XYZ_N(n, x, y, z)])
+                {
+                    highest[XZ_N(n, x, z)] = MAX(highest[XZ_N(n, x, z)], y);
+                    top = MAX(top, y);
+                }
+            }
+            END_MAP_FOR_EACH;
+        }
+    }
+
+    // the border is owned by the neighbors, which may have been edited
+    // since the center chunk was generated
+    if (!has_light)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            for (int b = 0; b < 3; b++)
+            {
+                Map *map = item->block_maps[a][b];
+                if (map && (a != 1 || b != 1))
+                {
+                    top = MAX(top, extract_rim(
+                        map, a, b, ox, oz, height, opaque, highest));
+                }
+            }
+        }
+    }
+
+    // flood fill light intensities
+    if (has_light)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            for (int b = 0; b < 3; b++)
+            {
+                Map *map = item->light_maps[a][b];
+                if (!map)
+                {
+                    continue;
+                }
+                MAP_FOR_EACH(map, ex, ey, ez, ew)
+                {
+                    int x = ex - ox;
+                    int y = ey - oy;
+                    int z = ez - oz;
+                    light_fill(opaque, light, height, x, y, z, ew, 1);
+                    light_lo = MIN(light_lo, y - ew);
+                    light_hi = MAX(light_hi, y + ew);
+                }
+                END_MAP_FOR_EACH;
+            }
+        }
+    }
+
+    // mesh urgent chunks as several slabs in parallel, and join them up
+    Map *map = item->block_maps[1][1];
+    MeshSlab slabs[MESH_SLABS];
+    int count = split_slabs(
+        map, item->urgent ? MIN(MESH_SLABS, sched_threads() + 1) : 1, slabs);
+    for (int i = 0; i < count; i++)
+    {
+        MeshSlab *slab = slabs + i;
+        slab->map = map;
+        slab->opaque = opaque;
+        slab->light = light;
+        slab->highest = highest;
+        slab->n = n;
+        slab->ox = ox;
+        slab->oy = oy;
+        slab->oz = oz;
+    }
+    sched_parallel(mesh_slab_at, slabs, count);
+    int miny = slabs[0].miny;
+    int maxy = slabs[0].maxy;
+    int faces = slabs[0].faces;
+    GLfloat *data = slabs[0].data;
+    if (count > 1)
+    {
+        for (int i = 1; i < count; i++)
+        {
+            miny = MIN(miny, slabs[i].miny);
+            maxy = MAX(maxy, slabs[i].maxy);
+            faces += slabs[i].faces;
+        }
+        data = malloc_faces(10, faces);
+        int offset = 0;
+        for (int i = 0; i < count; i++)
+        {
+            memcpy(
+                data + offset, slabs[i].data,
+                sizeof(GLfloat) * slabs[i].faces * 60);
+            offset += slabs[i].faces * 60;
+            free(slabs[i].data);
+        }
+    }
+
+    // leave the scratch buffers zeroed for the next call
+    memset(opaque, 0, n * n * (top + 1));
+    light_lo = MAX(light_lo, 0);
+    light_hi = MIN(light_hi, height - 1);
+    if (light_lo <= light_hi)
+    {
+        memset(light + n * n * light_lo, 0, n * n * (light_hi - light_lo + 1));
+    }
+    memset(highest, 0, n * n * sizeof(short));
 
     item->miny = miny;
     item->maxy = maxy;
@@ -1102,11 +1361,17 @@ Generates the chunk to prepare it to be rendered.
 */
 void generate_chunk(Chunk *chunk, WorkerItem *item)
 {
+    g->chunk_stats.meshes++;
+    if (chunk->buffer)
+    {
+        g->chunk_stats.remeshes++;
+    }
     chunk->miny = item->miny;
     chunk->maxy = item->maxy;
     chunk->faces = item->faces;
     del_buffer(chunk->buffer);
     chunk->buffer = gen_faces(10, item->faces, item->data);
+    item->data = 0;
     gen_sign_buffer(chunk);
 }
 
@@ -1120,17 +1385,15 @@ void gen_chunk_buffer(Chunk *chunk)
     WorkerItem *item = &_item;
     item->p = chunk->p;
     item->q = chunk->q;
+    item->urgent = 1;
     for (int dp = -1; dp <= 1; dp++)
     {
         for (int dq = -1; dq <= 1; dq++)
         {
-            Chunk *other = chunk;
-            if (dp || dq)
-            {
-                other = find_chunk(chunk->p + dp, chunk->q + dq, g);
-            }
+            Chunk *other = chunk->neighbors[dp + 1][dq + 1];
             if (other)
             {
+                chunk_unpack(other, g);
                 item->block_maps[dp + 1][dq + 1] = &other->map;
                 item->light_maps[dp + 1][dq + 1] = &other->lights;
             }
@@ -1141,9 +1404,11 @@ void gen_chunk_buffer(Chunk *chunk)
             }
         }
     }
-    compute_chunk(item);
+    compute_chunk(item, &g->scratch);
     generate_chunk(chunk, item);
     chunk->dirty = 0;
+    chunk->edits = 0;
+    chunk->mesh_time = glfwGetTime();
 }
 
 /**
@@ -1186,6 +1451,22 @@ void request_chunk(int p, int q)
     client_chunk(p, q, key);
 }
 
+/**
+Hands the block and light maps produced by a load over to the chunk without copying them.
+The item's maps are left empty and the chunk is requested from the server.
+\param[in,out] chunk: The chunk that takes ownership of the loaded maps.
+\param[in,out] item: Struct that holds the maps that were loaded for the chunk.
+*/
+void adopt_chunk(Chunk *chunk, WorkerItem *item)
+{
+    map_move(&chunk->map, item->block_maps[1][1]);
+    map_move(&chunk->lights, item->light_maps[1][1]);
+    chunk->loaded = 1;
+    chunk_hot_update(chunk, g);
+    g->chunk_stats.loads++;
+    request_chunk(item->p, item->q);
+}
+
 /**
 Initializes a a chunk with all the data it needs.
 \param[out] chunk: The pointer for the chunk that will be initialized.
@@ -1196,10 +1477,23 @@ void init_chunk(Chunk *chunk, int p, int q)
 {
     chunk->p = p;
     chunk->q = q;
+    chunk_index_insert(chunk, g);
+    chunk_link(chunk, g);
     chunk->faces = 0;
     chunk->sign_faces = 0;
     chunk->buffer = 0;
     chunk->sign_buffer = 0;
+    chunk->miny = 0;
+    chunk->maxy = 0;
+    chunk->dirty = 0;
+    chunk->busy = 0;
+    chunk->loaded = 0;
+    chunk->packed = 0;
+    chunk->edits = 0;
+    chunk->mesh_time = 0;
+    chunk->held = 0;
+    chunk_hot_update(chunk, g);
+    g->chunk_hot.used[chunk->order] = g->frame;
     dirty_chunk(chunk, g);
     SignList *signs = &chunk->signs;
     sign_list_alloc(signs, 16);
@@ -1230,243 +1524,677 @@ void create_chunk(Chunk *chunk, int p, int q)
     item->block_maps[1][1] = &chunk->map;
     item->light_maps[1][1] = &chunk->lights;
     load_chunk(item);
+    adopt_chunk(chunk, item);
+    wake_waiting_neighbors(chunk, g);
+}
 
+/**
+Creates a chunk from the contents that were cached when it was last deleted, so that it
+does not have to be loaded again. It is only meshed again if it was dirty or lit, since
+light from its neighbors may have changed while it was away.
+\param[in] p: Part of the set to identify the chunk.
+\param[in] q: Part of the set to identify the chunk.
+\return Returns the chunk, or 0 if it was not cached.
+*/
+Chunk *revive_chunk(int p, int q)
+{
+    CachedChunk *cached = chunk_cache_find(p, q, g);
+    if (!cached)
+    {
+        return 0;
+    }
+    Chunk *chunk = chunk_alloc(g);
+    chunk->p = p;
+    chunk->q = q;
+    chunk_index_insert(chunk, g);
+    chunk_link(chunk, g);
+    chunk_cache_take(chunk, cached, g);
+    chunk->busy = 0;
+    chunk->loaded = 1;
+    chunk->packed = 0;
+    chunk->edits = 0;
+    chunk->mesh_time = 0;
+    chunk->held = 0;
+    g->chunk_stats.revives++;
+    chunk_hot_update(chunk, g);
+    g->chunk_hot.used[chunk->order] = g->frame;
+    wake_waiting_neighbors(chunk, g);
+    if (chunk->dirty || !chunk->buffer || has_lights(chunk, g))
+    {
+        chunk->dirty = 0;
+        dirty_chunk(chunk, g);
+    }
     request_chunk(p, q);
+    return chunk;
+}
+
+/**
+Frees the blocks, lights, signs and GL buffers of a chunk that is about to be released.
+\param[in,out] chunk: The chunk to free the contents of.
+*/
+void unload_chunk(Chunk *chunk)
+{
+    map_free(&chunk->map);
+    map_free(&chunk->lights);
+    packed_map_free(&chunk->packed_map);
+    packed_map_free(&chunk->packed_lights);
+    chunk->packed = 0;
+    sign_list_free(&chunk->signs);
+    del_buffer(chunk->buffer);
+    del_buffer(chunk->sign_buffer);
+}
+
+/**
+Deletes chunks that are marked for deletion.
+*/
+void delete_chunks()
+{
+    State *s1 = &g->players->state;
+    State *s2 = &(g->players + g->observe1)->state;
+    State *s3 = &(g->players + g->observe2)->state;
+    State *states[3] = {s1, s2, s3};
+    ChunkHot *hot = &g->chunk_hot;
+    // walk backwards, releasing a chunk moves the last one into its place
+    for (int i = g->chunk_count - 1; i >= 0; i--)
+    {
+        int delete = 1;
+        for (int j = 0; j < 3; j++)
+        {
+            State *s = states[j];
+            int p = chunked(s->x);
+            int q = chunked(s->z);
+            if (MAX(ABS(hot->p[i] - p), ABS(hot->q[i] - q)) <
+                g->delete_radius)
+            {
+                delete = 0;
+                break;
+            }
+        }
+        if (delete)
+        {
+            Chunk *chunk = g->chunks[i];
+            if (!chunk_cache_put(chunk, g))
+            {
+                unload_chunk(chunk);
+            }
+            chunk_index_remove(chunk, g);
+            chunk_unlink(chunk);
+            chunk_release(chunk, g);
+        }
+    }
+}
+
+/**
+Deletes all chunks in the game world.
+*/
+void delete_all_chunks()
+{
+    for (int i = 0; i < g->chunk_count; i++)
+    {
+        unload_chunk(g->chunks[i]);
+    }
+    chunk_table_clear(g);
+    chunk_cache_clear(g);
+}
+
+/**
+Orders residency candidates farthest first, and least recently drawn first at the same
+distance.
+\param[in] a: The first ResidencyCandidate.
+\param[in] b: The second ResidencyCandidate.
+\return Returns a negative number if a should be demoted before b.
+*/
+int residency_compare(const void *a, const void *b)
+{
+    const ResidencyCandidate *ca = (const ResidencyCandidate *)a;
+    const ResidencyCandidate *cb = (const ResidencyCandidate *)b;
+    if (ca->distance != cb->distance)
+    {
+        return cb->distance - ca->distance;
+    }
+    return ca->used - cb->used;
+}
+
+/**
+Keeps chunk data within g->ram_budget and chunk GL buffers within g->vram_budget. Nothing
+happens while both fit. Otherwise memory is freed until usage is below RESIDENCY_LOW_WATER
+of each budget, so that a frame that goes over does not leave the next one over as well.
+The oldest entries of the chunk cache go first. Then chunks are demoted in
+residency_compare order, one tier at a time, skipping chunks that are busy with a job.
+First the GL buffers of chunks outside the render and create radius are dropped; they are
+meshed again when they come back into range. Then the maps of chunks outside the create
+radius are packed; they are unpacked when touched. Last, those chunks are unloaded.
+*/
+void manage_residency()
+{
+    ChunkHot *hot = &g->chunk_hot;
+    size_t ram = 0;
+    size_t vram = 0;
+    for (int i = 0; i < g->chunk_count; i++)
+    {
+        ram += hot->ram[i];
+        vram += hot->vram[i];
+    }
+    size_t cache_ram, cache_vram;
+    chunk_cache_usage(g, &cache_ram, &cache_vram);
+    if (ram + cache_ram <= g->ram_budget && vram + cache_vram <= g->vram_budget)
+    {
+        return;
+    }
+    size_t ram_target = g->ram_budget * RESIDENCY_LOW_WATER;
+    size_t vram_target = g->vram_budget * RESIDENCY_LOW_WATER;
+    while ((ram + cache_ram > ram_target || vram + cache_vram > vram_target) &&
+        chunk_cache_evict(g))
+    {
+        chunk_cache_usage(g, &cache_ram, &cache_vram);
+    }
+    ram += cache_ram;
+    vram += cache_vram;
+    if (ram <= ram_target && vram <= vram_target)
+    {
+        return;
+    }
+    State *s1 = &g->players->state;
+    State *s2 = &(g->players + g->observe1)->state;
+    State *s3 = &(g->players + g->observe2)->state;
+    State *states[3] = {s1, s2, s3};
+    int count = g->chunk_count;
+    ResidencyCandidate *candidates =
+        malloc(sizeof(ResidencyCandidate) * count);
+    for (int i = 0; i < count; i++)
+    {
+        int distance = 0x7fffffff;
+        for (int j = 0; j < 3; j++)
+        {
+            int p = chunked(states[j]->x);
+            int q = chunked(states[j]->z);
+            distance = MIN(
+                distance, MAX(ABS(hot->p[i] - p), ABS(hot->q[i] - q)));
+        }
+        candidates[i].chunk = g->chunks[i];
+        candidates[i].distance = distance;
+        candidates[i].used = hot->used[i];
+    }
+    qsort(candidates, count, sizeof(ResidencyCandidate), residency_compare);
+    int mesh_radius = MAX(g->render_radius, g->create_radius);
+    for (int i = 0; i < count && vram > vram_target; i++)
+    {
+        Chunk *chunk = candidates[i].chunk;
+        if (candidates[i].distance <= mesh_radius)
+        {
+            break;
+        }
+        if (chunk->busy)
+        {
+            continue;
+        }
+        vram -= hot->vram[chunk->order];
+        del_buffer(chunk->buffer);
+        del_buffer(chunk->sign_buffer);
+        chunk->buffer = 0;
+        chunk->sign_buffer = 0;
+        chunk->faces = 0;
+        chunk->sign_faces = 0;
+        chunk->dirty = 1;
+        chunk_hot_update(chunk, g);
+    }
+    // chunks within the create radius are meshed against their neighbors,
+    // which would unpack them again straight away
+    for (int i = 0; i < count && ram > ram_target; i++)
+    {
+        Chunk *chunk = candidates[i].chunk;
+        if (candidates[i].distance <= g->create_radius)
+        {
+            break;
+        }
+        if (chunk->busy || chunk->packed)
+        {
+            continue;
+        }
+        ram -= hot->ram[chunk->order];
+        chunk_pack(chunk, g);
+        ram += hot->ram[chunk->order];
+    }
+    for (int i = 0; i < count && ram > ram_target; i++)
+    {
+        Chunk *chunk = candidates[i].chunk;
+        if (candidates[i].distance <= g->create_radius)
+        {
+            break;
+        }
+        if (chunk->busy)
+        {
+            continue;
+        }
+        ram -= hot->ram[chunk->order];
+        unload_chunk(chunk);
+        chunk_index_remove(chunk, g);
+        chunk_unlink(chunk);
+        chunk_release(chunk, g);
+    }
+    free(candidates);
 }
 
 /**
-Deletes chunks that are marked for deletion.
+Frees the maps a WorkerItem was handed and the item itself.
+\param[in] item: The WorkerItem of a finished job.
 */
-void delete_chunks()
+void free_worker_item(WorkerItem *item)
 {
-    int count = g->chunk_count;
-    State *s1 = &g->players->state;
-    State *s2 = &(g->players + g->observe1)->state;
-    State *s3 = &(g->players + g->observe2)->state;
-    State *states[3] = {s1, s2, s3};
-    for (int i = 0; i < count; i++)
+    for (int a = 0; a < 3; a++)
     {
-        Chunk *chunk = g->chunks + i;
-        int delete = 1;
-        for (int j = 0; j < 3; j++)
+        for (int b = 0; b < 3; b++)
         {
-            State *s = states[j];
-            int p = chunked(s->x);
-            int q = chunked(s->z);
-            if (chunk_distance(chunk, p, q) < g->delete_radius)
+            Map *block_map = item->block_maps[a][b];
+            Map *light_map = item->light_maps[a][b];
+            if (block_map)
             {
-                delete = 0;
-                break;
+                map_free(block_map);
+                free(block_map);
+            }
+            if (light_map)
+            {
+                map_free(light_map);
+                free(light_map);
             }
-        }
-        if (delete)
-        {
-            map_free(&chunk->map);
-            map_free(&chunk->lights);
-            sign_list_free(&chunk->signs);
-            del_buffer(chunk->buffer);
-            del_buffer(chunk->sign_buffer);
-            Chunk *other = g->chunks + (--count);
-            memcpy(chunk, other, sizeof(Chunk));
         }
     }
-    g->chunk_count = count;
+    free(item);
 }
 
 /**
-Deletes all chunks in the game world.
+Runs the load stage of a chunk on a scheduler thread: generates its terrain and reads its
+blocks and lights from the database.
+\param[in,out] job: The Job of the WorkerItem to work on.
+\param[in] thread: Index of the scheduler thread.
 */
-void delete_all_chunks()
+void load_job_run(Job *job, int thread)
 {
-    for (int i = 0; i < g->chunk_count; i++)
+    load_chunk((WorkerItem *)job);
+}
+
+/**
+Hands the maps produced by a load job to its chunk, if it is still loaded, and queues the
+chunk for meshing. Neighbors whose meshing was put off until this chunk arrived are queued
+again, and lit neighbors are marked dirty since the chunk's lights reach into them.
+\param[in] job: The Job of the finished WorkerItem.
+*/
+void load_job_done(Job *job)
+{
+    WorkerItem *item = (WorkerItem *)job;
+    Chunk *chunk = chunk_from_handle(item->chunk, g);
+    g->load_jobs--;
+    if (chunk)
     {
-        Chunk *chunk = g->chunks + i;
-        map_free(&chunk->map);
-        map_free(&chunk->lights);
-        sign_list_free(&chunk->signs);
-        del_buffer(chunk->buffer);
-        del_buffer(chunk->sign_buffer);
+        adopt_chunk(chunk, item);
+        chunk->busy = 0;
+        wake_waiting_neighbors(chunk, g);
+        chunk->dirty = 0;
+        dirty_chunk(chunk, g);
     }
-    g->chunk_count = 0;
+    free_worker_item(item);
+}
+
+/**
+Runs the mesh stage of a chunk on a scheduler thread.
+\param[in,out] job: The Job of the WorkerItem to work on.
+\param[in] thread: Index of the scheduler thread, used to pick its scratch buffers.
+*/
+void mesh_job_run(Job *job, int thread)
+{
+    compute_chunk((WorkerItem *)job, g->worker_scratch + thread);
 }
 
 /**
-Checks if worker objects have finished their tasks and sets them to idle if they have.
+Uploads the geometry built by a mesh job to its chunk, if it is still loaded, and frees
+the job.
+\param[in] job: The Job of the finished WorkerItem.
 */
-void check_workers()
+void mesh_job_done(Job *job)
 {
-    for (int i = 0; i < WORKERS; i++)
+    WorkerItem *item = (WorkerItem *)job;
+    Chunk *chunk = chunk_from_handle(item->chunk, g);
+    g->mesh_jobs--;
+    if (chunk)
     {
-        Worker *worker = g->workers + i;
-        mtx_lock(&worker->mtx);
-        if (worker->state == WORKER_DONE)
+        generate_chunk(chunk, item);
+        chunk->busy = 0;
+        if (chunk->dirty)
         {
-            WorkerItem *item = &worker->item;
-            Chunk *chunk = find_chunk(item->p, item->q, g);
-            if (chunk)
-            {
-                if (item->load)
-                {
-                    Map *block_map = item->block_maps[1][1];
-                    Map *light_map = item->light_maps[1][1];
-                    map_free(&chunk->map);
-                    map_free(&chunk->lights);
-                    map_copy(&chunk->map, block_map);
-                    map_copy(&chunk->lights, light_map);
-                    request_chunk(item->p, item->q);
-                }
-                generate_chunk(chunk, item);
-            }
-            for (int a = 0; a < 3; a++)
-            {
-                for (int b = 0; b < 3; b++)
-                {
-                    Map *block_map = item->block_maps[a][b];
-                    Map *light_map = item->light_maps[a][b];
-                    if (block_map)
-                    {
-                        map_free(block_map);
-                        free(block_map);
-                    }
-                    if (light_map)
-                    {
-                        map_free(light_map);
-                        free(light_map);
-                    }
-                }
-            }
-            worker->state = WORKER_IDLE;
+            chunk_queue_push(chunk->p, chunk->q, g);
         }
-        mtx_unlock(&worker->mtx);
     }
+    else
+    {
+        free(item->data);
+    }
+    free_worker_item(item);
 }
 
 /**
-Forces a chunk to be generated.
+Rebuilds the chunk queue if the player has moved to another chunk, turned far enough, or
+changed course since it was last built. Every missing or dirty chunk within the create
+radius is scored by distance and visibility. The player's velocity is extrapolated
+PREFETCH_TIME seconds ahead: chunks near that path are scored as if they were visible and
+as close as the path comes to them, and chunks behind the direction of travel (or of
+sight, when standing still) count as twice as far away.
+\param[in] player: The player that chunks are being created around.
 */
-void force_chunks(Player *player)
+void update_chunk_queue(Player *player)
 {
     State *s = &player->state;
+    ChunkQueue *queue = &g->chunk_queue;
+    double now = glfwGetTime();
+    double dt = now - queue->time;
+    float dx = s->x - queue->x;
+    float dz = s->z - queue->z;
+    float moved = sqrtf(dx * dx + dz * dz);
+    if (dt > 0 && dt < 1 && moved <= CHUNK_SIZE &&
+        moved <= dt * MAX_TRAVEL_SPEED)
+    {
+        float alpha = MIN(dt * 4, 1);
+        queue->vx += (dx / dt - queue->vx) * alpha;
+        queue->vz += (dz / dt - queue->vz) * alpha;
+    }
+    else
+    {
+        // first update, a teleport (moving further than a chunk or faster
+        // than MAX_TRAVEL_SPEED in one frame) or the clock was set by the
+        // server: start smoothing again from standing still
+        queue->vx = 0;
+        queue->vz = 0;
+    }
+    queue->x = s->x;
+    queue->z = s->z;
+    queue->time = now;
     int p = chunked(s->x);
     int q = chunked(s->z);
-    int r = 1;
+    int predicted_p = chunked(s->x + queue->vx * PREFETCH_TIME);
+    int predicted_q = chunked(s->z + queue->vz * PREFETCH_TIME);
+    int r = g->create_radius;
+    float threshold = RADIANS(REQUEUE_ANGLE);
+    if (queue->valid && queue->p == p && queue->q == q &&
+        queue->predicted_p == predicted_p &&
+        queue->predicted_q == predicted_q &&
+        queue->radius == r && queue->fov == g->fov &&
+        queue->ortho == g->ortho &&
+        ABS(s->rx - queue->rx) < threshold &&
+        ABS(s->ry - queue->ry) < threshold)
+    {
+        return;
+    }
+    float matrix[16];
+    set_matrix_3d(
+        matrix, g->width, g->height,
+        s->x, s->y, s->z, s->rx, s->ry, g->fov, g->ortho, g->render_radius);
+    float planes[6][4];
+    frustum_planes(planes, g->render_radius, matrix);
+    if (!queue->scores || queue->radius != r)
+    {
+        free(queue->scores);
+        queue->scores = malloc(sizeof(int) * (2 * r + 1) * (2 * r + 1));
+    }
+    queue->load.size = 0;
+    queue->mesh.size = 0;
+    queue->valid = 1;
+    queue->p = p;
+    queue->q = q;
+    queue->radius = r;
+    queue->rx = s->rx;
+    queue->ry = s->ry;
+    queue->fov = g->fov;
+    queue->ortho = g->ortho;
+    queue->predicted_p = predicted_p;
+    queue->predicted_q = predicted_q;
+    // the predicted path and the heading, in chunks
+    float cx = s->x / CHUNK_SIZE;
+    float cz = s->z / CHUNK_SIZE;
+    float ex = queue->vx * PREFETCH_TIME / CHUNK_SIZE;
+    float ez = queue->vz * PREFETCH_TIME / CHUNK_SIZE;
+    float length2 = ex * ex + ez * ez;
+    float speed = sqrtf(queue->vx * queue->vx + queue->vz * queue->vz);
+    float hx = cosf(s->rx - RADIANS(90));
+    float hz = sinf(s->rx - RADIANS(90));
+    if (speed > 1)
+    {
+        hx = queue->vx / speed;
+        hz = queue->vz / speed;
+    }
+    int *score = queue->scores;
     for (int dp = -r; dp <= r; dp++)
     {
         for (int dq = -r; dq <= r; dq++)
         {
             int a = p + dp;
             int b = q + dq;
-            Chunk *chunk = find_chunk(a, b, g);
-            if (chunk)
+            int distance = MAX(ABS(dp), ABS(dq));
+            int invisible = !chunk_visible(planes, a, b, 0, WORLD_HEIGHT);
+            float ox = a + 0.5f - cx;
+            float oz = b + 0.5f - cz;
+            if (length2 > 0)
             {
-                if (chunk->dirty)
+                float t = MAX(0, MIN(1, (ox * ex + oz * ez) / length2));
+                float fx = ox - t * ex;
+                float fz = oz - t * ez;
+                float path = sqrtf(fx * fx + fz * fz);
+                if (path < 1)
                 {
-                    gen_chunk_buffer(chunk);
+                    invisible = 0;
                 }
+                distance = MIN(distance, (int)path + 1);
             }
-            else if (g->chunk_count < MAX_CHUNKS)
+            if (ox * hx + oz * hz < -1)
             {
-                chunk = g->chunks + g->chunk_count++;
-                create_chunk(chunk, a, b);
-                gen_chunk_buffer(chunk);
+                distance *= 2;
             }
+            *score++ = (invisible << 24) | distance;
         }
     }
-}
-
-/**
-Checks that the chunks have been created correctly.
-\param[in] player: The player that caused the chunk to spawn.
-\param[in] worker: The worker in charge of the chunk.
-*/
-void ensure_chunks_worker(Player *player, Worker *worker)
-{
-    State *s = &player->state;
-    float matrix[16];
-    set_matrix_3d(
-        matrix, g->width, g->height,
-        s->x, s->y, s->z, s->rx, s->ry, g->fov, g->ortho, g->render_radius);
-    float planes[6][4];
-    frustum_planes(planes, g->render_radius, matrix);
-    int p = chunked(s->x);
-    int q = chunked(s->z);
-    int r = g->create_radius;
-    int start = 0x0fffffff;
-    int best_score = start;
-    int best_a = 0;
-    int best_b = 0;
     for (int dp = -r; dp <= r; dp++)
     {
         for (int dq = -r; dq <= r; dq++)
         {
             int a = p + dp;
             int b = q + dq;
-            int index = (ABS(a) ^ ABS(b)) % WORKERS;
-            if (index != worker->index)
-            {
-                continue;
-            }
             Chunk *chunk = find_chunk(a, b, g);
-            if (chunk && !chunk->dirty)
-            {
-                continue;
-            }
-            int distance = MAX(ABS(dp), ABS(dq));
-            int invisible = !chunk_visible(planes, a, b, 0, 256);
-            int priority = 0;
-            if (chunk)
-            {
-                priority = chunk->buffer && chunk->dirty;
-            }
-            int score = (invisible << 24) | (priority << 16) | distance;
-            if (score < best_score)
+            if (!chunk || (chunk->dirty && !chunk->busy))
             {
-                best_score = score;
-                best_a = a;
-                best_b = b;
+                chunk_queue_push(a, b, g);
             }
         }
     }
-    if (best_score == start)
+}
+
+/**
+Creates a chunk and submits a job that loads its blocks and lights, unless the chunk can
+be revived from the chunk cache.
+\param[in] a: Part of the set to identify the chunk.
+\param[in] b: Part of the set to identify the chunk.
+\param[in] urgent: Set to run the job ahead of those already submitted.
+*/
+void load_chunk_async(int a, int b, int urgent)
+{
+    if (revive_chunk(a, b))
     {
         return;
     }
-    int a = best_a;
-    int b = best_b;
-    int load = 0;
-    Chunk *chunk = find_chunk(a, b, g);
-    if (!chunk)
+    Chunk *chunk = chunk_alloc(g);
+    init_chunk(chunk, a, b);
+    WorkerItem *item = calloc(1, sizeof(WorkerItem));
+    item->job.run = load_job_run;
+    item->job.done = load_job_done;
+    item->p = a;
+    item->q = b;
+    item->chunk = chunk_handle(chunk);
+    // the worker fills these in, so they must be private
+    Map *map = &chunk->map;
+    Map *lights = &chunk->lights;
+    item->block_maps[1][1] = malloc(sizeof(Map));
+    item->light_maps[1][1] = malloc(sizeof(Map));
+    map_alloc(item->block_maps[1][1], map->dx, map->dy, map->dz, map->mask);
+    map_alloc(
+        item->light_maps[1][1], lights->dx, lights->dy, lights->dz,
+        lights->mask);
+    chunk->dirty = 0;
+    chunk->busy = 1;
+    g->load_jobs++;
+    if (urgent)
+    {
+        sched_submit_urgent(&item->job);
+    }
+    else
+    {
+        sched_submit(&item->job);
+    }
+}
+
+/**
+Creates the best chunk in the load heap of the chunk queue with load_chunk_async. Jobs for
+chunks that have been created since are dropped.
+\return Returns 1 if a chunk was created and 0 if the heap ran out.
+*/
+int submit_load_job()
+{
+    int a, b;
+    do
     {
-        load = 1;
-        if (g->chunk_count < MAX_CHUNKS)
+        if (!chunk_heap_pop(&g->chunk_queue.load, &a, &b))
         {
-            chunk = g->chunks + g->chunk_count++;
-            init_chunk(chunk, a, b);
+            return 0;
         }
-        else
+    } while (find_chunk(a, b, g));
+    load_chunk_async(a, b, 0);
+    return 1;
+}
+
+/**
+Checks whether a chunk should wait for one of its four side neighbors before it is meshed.
+Light spills across the seam, so meshing before a neighbor is loaded means meshing again
+once it is. Only neighbors within the radius of the chunk queue are waited for, as the
+others are not going to be loaded. Each chunk that has to wait is counted in
+g->chunk_stats.
+\param[in] chunk: A dirty chunk that is about to be meshed.
+\return Returns 1 if the chunk should wait.
+*/
+int defer_mesh(Chunk *chunk)
+{
+    static const int sides[4][2] = {{0, 1}, {2, 1}, {1, 0}, {1, 2}};
+    ChunkQueue *queue = &g->chunk_queue;
+    if (!queue->valid)
+    {
+        return 0;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        int a = sides[i][0];
+        int b = sides[i][1];
+        Chunk *other = chunk->neighbors[a][b];
+        if (other && other->loaded)
+        {
+            continue;
+        }
+        int p = chunk->p + a - 1;
+        int q = chunk->q + b - 1;
+        if (ABS(p - queue->p) <= queue->radius &&
+            ABS(q - queue->q) <= queue->radius)
+        {
+            g->chunk_stats.deferrals++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+Checks whether a chunk is being edited so quickly, e.g. by a builder streaming edits from
+the server, that its next mesh would be out of date on arrival. A chunk that was set dirty
+more than EDIT_STORM_RATE times a second since its last mesh was started is meshed at most
+once every REMESH_INTERVAL seconds. Until then it stays dirty and waits in g->held_chunks,
+and release_held_chunks queues it again, so the last edits of a burst are always meshed.
+\param[in] chunk: A dirty chunk that is about to be meshed.
+\return Returns 1 if the chunk is held back.
+*/
+int hold_mesh(Chunk *chunk)
+{
+    if (!chunk->buffer)
+    {
+        return 0;
+    }
+    if (glfwGetTime() - chunk->mesh_time >= REMESH_INTERVAL ||
+        chunk->edits <= EDIT_STORM_RATE * REMESH_INTERVAL)
+    {
+        return 0;
+    }
+    g->chunk_stats.holds++;
+    if (!chunk->held)
+    {
+        if (g->held_count == g->held_capacity)
+        {
+            g->held_capacity = g->held_capacity ? g->held_capacity * 2 : 16;
+            g->held_chunks = (ChunkHandle *)realloc(
+                g->held_chunks, sizeof(ChunkHandle) * g->held_capacity);
+        }
+        g->held_chunks[g->held_count++] = chunk_handle(chunk);
+        chunk->held = 1;
+    }
+    return 1;
+}
+
+/**
+Queues the held chunks whose REMESH_INTERVAL has passed to be meshed again.
+*/
+void release_held_chunks()
+{
+    double now = glfwGetTime();
+    int count = 0;
+    for (int i = 0; i < g->held_count; i++)
+    {
+        Chunk *chunk = chunk_from_handle(g->held_chunks[i], g);
+        if (!chunk)
+        {
+            continue;
+        }
+        if (now - chunk->mesh_time < REMESH_INTERVAL)
+        {
+            g->held_chunks[count++] = g->held_chunks[i];
+            continue;
+        }
+        chunk->held = 0;
+        if (chunk->dirty && !chunk->busy)
         {
-            return;
+            chunk_queue_push(chunk->p, chunk->q, g);
         }
     }
-    WorkerItem *item = &worker->item;
+    g->held_count = count;
+}
+
+/**
+Submits a job that meshes a dirty chunk, together with shared copies of the maps of its
+loaded neighbors. The chunk keeps drawing its current mesh until the new one is done.
+\param[in,out] chunk: The chunk to mesh, which must not be busy.
+\param[in] urgent: Set to run the job ahead of those already submitted.
+*/
+void mesh_chunk_async(Chunk *chunk, int urgent)
+{
+    WorkerItem *item = malloc(sizeof(WorkerItem));
+    item->job.run = mesh_job_run;
+    item->job.done = mesh_job_done;
+    item->urgent = urgent;
     item->p = chunk->p;
     item->q = chunk->q;
-    item->load = load;
+    item->chunk = chunk_handle(chunk);
     for (int dp = -1; dp <= 1; dp++)
     {
         for (int dq = -1; dq <= 1; dq++)
         {
-            Chunk *other = chunk;
-            if (dp || dq)
-            {
-                other = find_chunk(chunk->p + dp, chunk->q + dq, g);
-            }
+            Chunk *other = chunk->neighbors[dp + 1][dq + 1];
             if (other)
             {
                 Map *block_map = malloc(sizeof(Map));
-                map_copy(block_map, &other->map);
                 Map *light_map = malloc(sizeof(Map));
-                map_copy(light_map, &other->lights);
+                chunk_unpack(other, g);
+                map_share(block_map, &other->map);
+                map_share(light_map, &other->lights);
                 item->block_maps[dp + 1][dq + 1] = block_map;
                 item->light_maps[dp + 1][dq + 1] = light_map;
             }
@@ -1478,57 +2206,117 @@ void ensure_chunks_worker(Player *player, Worker *worker)
         }
     }
     chunk->dirty = 0;
-    worker->state = WORKER_BUSY;
-    cnd_signal(&worker->cnd);
+    chunk->busy = 1;
+    chunk->edits = 0;
+    chunk->mesh_time = glfwGetTime();
+    g->mesh_jobs++;
+    if (urgent)
+    {
+        sched_submit_urgent(&item->job);
+    }
+    else
+    {
+        sched_submit(&item->job);
+    }
 }
 
 /**
-Creates the worker for ensure_chunks and calls it to prepare for the creation of a chunk
-\param[in] player: 
+Meshes the best chunk in the mesh heap of the chunk queue with mesh_chunk_async. Jobs for
+chunks that have been meshed since, or that are still loading or meshing, are dropped, and
+so are jobs for chunks that have to wait for a neighbor or are held back by hold_mesh;
+those are queued again when the neighbor loads or the hold ends.
+\return Returns 1 if a job was submitted and 0 if the heap ran out.
 */
-void ensure_chunks(Player *player)
+int submit_mesh_job()
 {
-    check_workers();
-    force_chunks(player);
-    for (int i = 0; i < WORKERS; i++)
+    int a, b;
+    Chunk *chunk;
+    do
     {
-        Worker *worker = g->workers + i;
-        mtx_lock(&worker->mtx);
-        if (worker->state == WORKER_IDLE)
+        if (!chunk_heap_pop(&g->chunk_queue.mesh, &a, &b))
         {
-            ensure_chunks_worker(player, worker);
+            return 0;
         }
-        mtx_unlock(&worker->mtx);
-    }
+        chunk = find_chunk(a, b, g);
+    } while (!chunk || !chunk->dirty || chunk->busy || defer_mesh(chunk) ||
+        hold_mesh(chunk));
+    mesh_chunk_async(chunk, 0);
+    return 1;
 }
 
 /**
-Starts up a worker on a new task.
-\param[in] arg: What the worker will run.
+Keeps the chunks around a player loaded and meshed ahead of the chunk queue, e.g. after an
+edit or a teleport. Their jobs go to the scheduler's urgent lane, and a chunk that already
+has a mesh keeps drawing it until the new one is done. Only the chunk the player is in is
+created and meshed on the spot, and only while it has no mesh, since collision and spawning
+need its blocks.
+\param[in] player: The player whose surroundings are needed.
 */
-int worker_run(void *arg)
+void force_chunks(Player *player)
 {
-    Worker *worker = (Worker *)arg;
-    int running = 1;
-    while (running)
+    State *s = &player->state;
+    int p = chunked(s->x);
+    int q = chunked(s->z);
+    int r = 1;
+    for (int dp = -r; dp <= r; dp++)
     {
-        mtx_lock(&worker->mtx);
-        while (worker->state != WORKER_BUSY)
-        {
-            cnd_wait(&worker->cnd, &worker->mtx);
-        }
-        mtx_unlock(&worker->mtx);
-        WorkerItem *item = &worker->item;
-        if (item->load)
+        for (int dq = -r; dq <= r; dq++)
         {
-            load_chunk(item);
+            int a = p + dp;
+            int b = q + dq;
+            int here = dp == 0 && dq == 0;
+            Chunk *chunk = find_chunk(a, b, g);
+            if (!chunk)
+            {
+                chunk = revive_chunk(a, b);
+            }
+            if (!chunk && !here)
+            {
+                load_chunk_async(a, b, 1);
+                continue;
+            }
+            if (!chunk)
+            {
+                chunk = chunk_alloc(g);
+                create_chunk(chunk, a, b);
+            }
+            if (!chunk->dirty || chunk->busy)
+            {
+                continue;
+            }
+            if (here && !chunk->buffer)
+            {
+                gen_chunk_buffer(chunk);
+            }
+            else
+            {
+                mesh_chunk_async(chunk, 1);
+            }
         }
-        compute_chunk(item);
-        mtx_lock(&worker->mtx);
-        worker->state = WORKER_DONE;
-        mtx_unlock(&worker->mtx);
     }
-    return 0;
+}
+
+/**
+Collects finished chunk jobs and submits new ones for each stage. Loads mostly wait on the
+database, so at most half the scheduler threads take them and meshing keeps going. Meshing
+keeps about two jobs per thread in flight so that a thread that runs dry has work to steal.
+Chunks are only ever created around the local player; the views of observed players just
+draw what is loaded, so the chunk queue is built for a single center once a frame.
+*/
+void ensure_chunks()
+{
+    Player *player = g->players;
+    sched_poll();
+    force_chunks(player);
+    release_held_chunks();
+    update_chunk_queue(player);
+    int threads = sched_threads();
+    while (g->load_jobs < MAX(1, threads / 2) && submit_load_job())
+    {
+    }
+    while (g->mesh_jobs < threads * 2 && submit_mesh_job())
+    {
+    }
 }
 
 /**
@@ -1540,7 +2328,6 @@ int render_chunks(Attrib *attrib, Player *player)
 {
     int result = 0;
     State *s = &player->state;
-    ensure_chunks(player);
     int p = chunked(s->x);
     int q = chunked(s->z);
     float light = get_daylight();
@@ -1559,20 +2346,21 @@ int render_chunks(Attrib *attrib, Player *player)
     glUniform1f(attrib->extra3, g->render_radius * CHUNK_SIZE);
     glUniform1i(attrib->extra4, g->ortho);
     glUniform1f(attrib->timer, time_of_day());
+    ChunkHot *hot = &g->chunk_hot;
     for (int i = 0; i < g->chunk_count; i++)
     {
-        Chunk *chunk = g->chunks + i;
-        if (chunk_distance(chunk, p, q) > g->render_radius)
+        if (MAX(ABS(hot->p[i] - p), ABS(hot->q[i] - q)) > g->render_radius)
         {
             continue;
         }
         if (!chunk_visible(
-                planes, chunk->p, chunk->q, chunk->miny, chunk->maxy))
+                planes, hot->p[i], hot->q[i], hot->miny[i], hot->maxy[i]))
         {
             continue;
         }
-        draw_chunk(attrib, chunk);
-        result += chunk->faces;
+        draw_chunk(attrib, hot->buffer[i], hot->faces[i]);
+        hot->used[i] = g->frame;
+        result += hot->faces[i];
     }
     return result;
 }
@@ -1597,19 +2385,19 @@ void render_signs(Attrib *attrib, Player *player)
     glUniformMatrix4fv(attrib->matrix, 1, GL_FALSE, matrix);
     glUniform1i(attrib->sampler, 3);
     glUniform1i(attrib->extra1, 1);
+    ChunkHot *hot = &g->chunk_hot;
     for (int i = 0; i < g->chunk_count; i++)
     {
-        Chunk *chunk = g->chunks + i;
-        if (chunk_distance(chunk, p, q) > g->sign_radius)
+        if (MAX(ABS(hot->p[i] - p), ABS(hot->q[i] - q)) > g->sign_radius)
         {
             continue;
         }
         if (!chunk_visible(
-                planes, chunk->p, chunk->q, chunk->miny, chunk->maxy))
+                planes, hot->p[i], hot->q[i], hot->miny[i], hot->maxy[i]))
         {
             continue;
         }
-        draw_signs(attrib, chunk);
+        draw_signs(attrib, hot->sign_buffer[i], hot->sign_faces[i]);
     }
 }
 
@@ -1818,8 +2606,8 @@ Resets the opengl model for the game.
 */
 void reset_model()
 {
-    memset(g->chunks, 0, sizeof(Chunk) * MAX_CHUNKS);
-    g->chunk_count = 0;
+    chunk_table_clear(g);
+    memset(&g->chunk_stats, 0, sizeof(ChunkStats));
     memset(g->players, 0, sizeof(Player) * MAX_PLAYERS);
     g->player_count = 0;
     g->observe1 = 0;
@@ -1903,6 +2691,7 @@ int collide(int height, float *x, float *y, float *z, Model *model)
     {
         return result;
     }
+    chunk_unpack(chunk, model);
     Map *map = &chunk->map;
     int nx = roundf(*x);
     int ny = roundf(*y);
@@ -1960,15 +2749,26 @@ int highest_block(float x, float z, Model *model)
     Chunk *chunk = find_chunk(p, q, model);
     if (chunk)
     {
+        // probe the column from the top instead of walking the whole map,
+        // skipping sections that hold no blocks
+        chunk_unpack(chunk, model);
         Map *map = &chunk->map;
-        MAP_FOR_EACH(map, ex, ey, ez, ew)
+        for (int i = MAP_SECTIONS - 1; i >= 0 && result == -1; i--)
         {
-            if (is_obstacle(ew) && ex == nx && ez == nz)
+            if (MAP_SECTION_EMPTY(map, i))
+            {
+                continue;
+            }
+            for (int y = SECTION_HEIGHT - 1; y >= 0; y--)
             {
-                result = MAX(result, ey);
+                int ey = map->dy + i * SECTION_HEIGHT + y;
+                if (is_obstacle(map_get(map, nx, ey, nz)))
+                {
+                    result = ey;
+                    break;
+                }
             }
         }
-        END_MAP_FOR_EACH;
     }
     return result;
 }
@@ -2287,6 +3087,7 @@ int main(int argc, char **argv)
 {
     // INITIALIZATION //
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    map_pool_init();
     srand(time(NULL));
     rand();
 
@@ -2442,17 +3243,15 @@ int main(int argc, char **argv)
     g->render_radius = RENDER_CHUNK_RADIUS;
     g->delete_radius = DELETE_CHUNK_RADIUS;
     g->sign_radius = RENDER_SIGN_RADIUS;
-
-    // INITIALIZE WORKER THREADS
-    for (int i = 0; i < WORKERS; i++)
+    g->ram_budget = (size_t)RAM_BUDGET << 20;
+    if (!g->ram_budget)
     {
-        Worker *worker = g->workers + i;
-        worker->index = i;
-        worker->state = WORKER_IDLE;
-        mtx_init(&worker->mtx, mtx_plain);
-        cnd_init(&worker->cnd);
-        thrd_create(&worker->thrd, worker_run, worker);
+        g->ram_budget = physical_memory() / 8;
     }
+    g->vram_budget = (size_t)VRAM_BUDGET << 20;
+
+    // INITIALIZE WORKER THREADS
+    sched_start(0);
 
     // OUTER LOOP //
     int running = 1;
@@ -2562,6 +3361,9 @@ int main(int argc, char **argv)
             g->observe1 = g->observe1 % g->player_count;
             g->observe2 = g->observe2 % g->player_count;
             delete_chunks();
+            manage_residency();
+            ensure_chunks();
+            g->frame++;
             del_buffer(me->buffer);
             me->buffer = gen_player_buffer(s->x, s->y, s->z, s->rx, s->ry);
             for (int i = 1; i < g->player_count; i++)
@@ -2615,6 +3417,18 @@ int main(int argc, char **argv)
                 render_text(&text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
                 ty -= ts * 2;
             }
+            if (SHOW_CHUNK_STATS)
+            {
+                ChunkStats *stats = &g->chunk_stats;
+                snprintf(
+                    text_buffer, 1024,
+                    "loads: %d (%d cached) meshes: %d (%d again) "
+                    "deferred: %d held: %d",
+                    stats->loads, stats->revives, stats->meshes,
+                    stats->remeshes, stats->deferrals, stats->holds);
+                render_text(&text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+                ty -= ts * 2;
+            }
             if (SHOW_CHAT_TEXT)
             {
                 for (int i = 0; i < MAX_MESSAGES; i++)
@@ -2703,6 +3517,9 @@ int main(int argc, char **argv)
         }
 
         // SHUTDOWN //
+        // load jobs read through the database connection, so they must
+        // all have finished before it is closed
+        sched_drain();
         db_save_state(s->x, s->y, s->z, s->rx, s->ry);
         db_close();
         db_disable();
@@ -2714,6 +3531,15 @@ int main(int argc, char **argv)
     }
 
     glfwTerminate();
+    sched_stop();
+    sched_poll();
+    scratch_free(&g->scratch);
+    for (int i = 0; i < MAX_SCHED_THREADS; i++)
+    {
+        scratch_free(g->worker_scratch + i);
+    }
+    chunk_table_free(g);
+    map_pool_free();
     curl_global_cleanup();
     return 0;
 }
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "map.h"
+#include "tinycthread.h"
 
 int hash_int(int key) {
     key = ~key + (key << 15);
@@ -13,10 +14,122 @@ int hash_int(int key) {
 }
 
 int hash(int x, int y, int z) {
-    x = hash_int(x);
-    y = hash_int(y);
-    z = hash_int(z);
-    return x ^ y ^ z;
+    // every coordinate gets its own odd multiplier before the final mix.
+    // xoring equal per-coordinate hashes made mirrored and permuted
+    // coordinates collide, which clustered the small offsets within a
+    // chunk into long probe runs
+    unsigned int key = (unsigned int)x * 0x9e3779b1u;
+    key ^= (unsigned int)y * 0x85ebca77u;
+    key ^= (unsigned int)z * 0xc2b2ae3du;
+    key ^= key >> 16;
+    key *= 0x7feb352du;
+    key ^= key >> 15;
+    key *= 0x846ca68bu;
+    key ^= key >> 16;
+    return (int)key;
+}
+
+// the slot just before a table holds the number of maps sharing it
+#define MAP_REFS(data) ((data)[-1].value)
+
+// released tables are kept by size class (one per power of two) so that
+// chunk churn reuses blocks instead of going back to the system allocator
+#define MAP_POOL_CLASSES 32
+#define MAP_POOL_DEPTH 16
+
+typedef struct {
+    int count;
+    MapEntry *blocks[MAP_POOL_DEPTH];
+} MapPool;
+
+static MapPool map_pool[MAP_POOL_CLASSES];
+static mtx_t map_pool_mtx;
+
+static int map_pool_class(unsigned int mask) {
+    int result = 0;
+    while (mask >>= 1) {
+        result++;
+    }
+    return result;
+}
+
+void map_pool_init() {
+    memset(map_pool, 0, sizeof(map_pool));
+    mtx_init(&map_pool_mtx, mtx_plain);
+}
+
+void map_pool_free() {
+    for (int i = 0; i < MAP_POOL_CLASSES; i++) {
+        MapPool *pool = map_pool + i;
+        for (int j = 0; j < pool->count; j++) {
+            free(pool->blocks[j]);
+        }
+        pool->count = 0;
+    }
+    mtx_destroy(&map_pool_mtx);
+}
+
+#define MAP_SET_BIT(map, i) (MAP_BITS(map)[(i) >> 5] |= 1u << ((i) & 31))
+#define MAP_CLEAR_BIT(map, i) (MAP_BITS(map)[(i) >> 5] &= ~(1u << ((i) & 31)))
+
+#if !defined(__GNUC__) && !defined(__clang__)
+int map_ctz(unsigned int bits) {
+    int result = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        result++;
+    }
+    return result;
+}
+#endif
+
+// bytes in a table and its occupancy bitmap, not counting the refs slot
+static size_t map_data_size(unsigned int mask) {
+    return (mask + 1) * sizeof(MapEntry) + MAP_WORDS(mask) * sizeof(unsigned int);
+}
+
+static MapEntry *map_data_alloc(unsigned int mask, int clear) {
+    MapPool *pool = map_pool + map_pool_class(mask);
+    MapEntry *block = 0;
+    mtx_lock(&map_pool_mtx);
+    if (pool->count) {
+        block = pool->blocks[--pool->count];
+    }
+    mtx_unlock(&map_pool_mtx);
+    if (!block) {
+        block = (MapEntry *)calloc(1, sizeof(MapEntry) + map_data_size(mask));
+    }
+    else if (clear) {
+        memset(block, 0, sizeof(MapEntry) + map_data_size(mask));
+    }
+    MapEntry *data = block + 1;
+    MAP_REFS(data) = 1;
+    return data;
+}
+
+static void map_data_release(MapEntry *data, unsigned int mask) {
+    if (!data || --MAP_REFS(data)) {
+        return;
+    }
+    MapPool *pool = map_pool + map_pool_class(mask);
+    MapEntry *block = data - 1;
+    mtx_lock(&map_pool_mtx);
+    if (pool->count < MAP_POOL_DEPTH) {
+        pool->blocks[pool->count++] = block;
+        block = 0;
+    }
+    mtx_unlock(&map_pool_mtx);
+    free(block);
+}
+
+static void map_own(Map *map) {
+    if (MAP_REFS(map->data) == 1) {
+        return;
+    }
+    MapEntry *data = map_data_alloc(map->mask, 0);
+    memcpy(data, map->data, map_data_size(map->mask));
+    map_data_release(map->data, map->mask);
+    map->data = data;
 }
 
 void map_alloc(Map *map, int dx, int dy, int dz, int mask) {
@@ -25,11 +138,12 @@ void map_alloc(Map *map, int dx, int dy, int dz, int mask) {
     map->dz = dz;
     map->mask = mask;
     map->size = 0;
-    map->data = (MapEntry *)calloc(map->mask + 1, sizeof(MapEntry));
+    memset(map->sections, 0, sizeof(map->sections));
+    map->data = map_data_alloc(map->mask, 1);
 }
 
 void map_free(Map *map) {
-    free(map->data);
+    map_data_release(map->data, map->mask);
 }
 
 void map_copy(Map *dst, Map *src) {
@@ -38,43 +152,134 @@ void map_copy(Map *dst, Map *src) {
     dst->dz = src->dz;
     dst->mask = src->mask;
     dst->size = src->size;
-    dst->data = (MapEntry *)calloc(dst->mask + 1, sizeof(MapEntry));
-    memcpy(dst->data, src->data, (dst->mask + 1) * sizeof(MapEntry));
+    memcpy(dst->sections, src->sections, sizeof(dst->sections));
+    dst->data = map_data_alloc(dst->mask, 0);
+    memcpy(dst->data, src->data, map_data_size(dst->mask));
 }
 
-int map_set(Map *map, int x, int y, int z, int w) {
-    unsigned int index = hash(x, y, z) & map->mask;
-    x -= map->dx;
-    y -= map->dy;
-    z -= map->dz;
+void map_move(Map *dst, Map *src) {
+    if (dst == src) {
+        return;
+    }
+    map_data_release(dst->data, dst->mask);
+    memcpy(dst, src, sizeof(Map));
+    src->size = 0;
+    memset(src->sections, 0, sizeof(src->sections));
+    src->data = 0;
+}
+
+void map_share(Map *dst, Map *src) {
+    memcpy(dst, src, sizeof(Map));
+    MAP_REFS(dst->data)++;
+}
+
+static unsigned int map_home(Map *map, MapEntry *entry) {
+    int x = entry->e.x + map->dx;
+    int y = entry->e.y + map->dy;
+    int z = entry->e.z + map->dz;
+    return hash(x, y, z) & map->mask;
+}
+
+static unsigned int map_distance(Map *map, unsigned int index) {
+    return (index - map_home(map, map->data + index)) & map->mask;
+}
+
+static void map_remove(Map *map, unsigned int index) {
+    // backward shift deletion: pull the rest of the cluster one slot
+    // closer to home so that no tombstone is left behind
+    map->sections[map->data[index].e.y / SECTION_HEIGHT]--;
+    while (1) {
+        unsigned int next = (index + 1) & map->mask;
+        MapEntry *entry = map->data + next;
+        if (EMPTY_ENTRY(entry) || map_distance(map, next) == 0) {
+            break;
+        }
+        map->data[index] = *entry;
+        index = next;
+    }
+    map->data[index].value = 0;
+    MAP_CLEAR_BIT(map, index);
+    map->size--;
+}
+
+static void map_insert(Map *map, MapEntry entry) {
+    // robin hood insertion: an entry that is further from its home slot
+    // takes the place of one that is closer to its own
+    unsigned int index = map_home(map, &entry);
+    unsigned int distance = 0;
+    map->sections[entry.e.y / SECTION_HEIGHT]++;
+    while (1) {
+        MapEntry *slot = map->data + index;
+        if (EMPTY_ENTRY(slot)) {
+            *slot = entry;
+            MAP_SET_BIT(map, index);
+            break;
+        }
+        unsigned int other = map_distance(map, index);
+        if (other < distance) {
+            MapEntry swap = *slot;
+            *slot = entry;
+            entry = swap;
+            distance = other;
+        }
+        index = (index + 1) & map->mask;
+        distance++;
+    }
+    map->size++;
+}
+
+static int map_store(
+    Map *map, unsigned int index, int x, int y, int z, int w)
+{
     MapEntry *entry = map->data + index;
-    int overwrite = 0;
     while (!EMPTY_ENTRY(entry)) {
         if (entry->e.x == x && entry->e.y == y && entry->e.z == z) {
-            overwrite = 1;
-            break;
+            if (entry->e.w == w) {
+                return 0;
+            }
+            map_own(map);
+            if (!w) {
+                map_remove(map, index);
+            }
+            else {
+                map->data[index].e.w = w;
+            }
+            return 1;
         }
         index = (index + 1) & map->mask;
         entry = map->data + index;
     }
-    if (overwrite) {
-        if (entry->e.w != w) {
-            entry->e.w = w;
-            return 1;
-        }
+    if (!w) {
+        return 0;
     }
-    else if (w) {
-        entry->e.x = x;
-        entry->e.y = y;
-        entry->e.z = z;
-        entry->e.w = w;
-        map->size++;
-        if (map->size * 2 > map->mask) {
-            map_grow(map);
-        }
-        return 1;
+    MapEntry new_entry;
+    new_entry.value = 0;
+    new_entry.e.x = x;
+    new_entry.e.y = y;
+    new_entry.e.z = z;
+    new_entry.e.w = w;
+    map_own(map);
+    map_insert(map, new_entry);
+    if (map->size * 2 > map->mask) {
+        map_grow(map);
     }
-    return 0;
+    return 1;
+}
+
+int map_set(Map *map, int x, int y, int z, int w) {
+    unsigned int index = hash(x, y, z) & map->mask;
+    x -= map->dx;
+    y -= map->dy;
+    z -= map->dz;
+    if (x < 0 || x >= MAP_WIDTH) return 0;
+    if (y < 0 || y >= MAP_HEIGHT) return 0;
+    if (z < 0 || z >= MAP_WIDTH) return 0;
+    return map_store(map, index, x, y, z, w);
+}
+
+int map_put(Map *map, int x, int y, int z, int w) {
+    unsigned int index = hash(x, y, z) & map->mask;
+    return map_store(map, index, x - map->dx, y - map->dy, z - map->dz, w);
 }
 
 int map_get(Map *map, int x, int y, int z) {
@@ -82,9 +287,9 @@ int map_get(Map *map, int x, int y, int z) {
     x -= map->dx;
     y -= map->dy;
     z -= map->dz;
-    if (x < 0 || x > 255) return 0;
-    if (y < 0 || y > 255) return 0;
-    if (z < 0 || z > 255) return 0;
+    if (x < 0 || x >= MAP_WIDTH) return 0;
+    if (y < 0 || y >= MAP_HEIGHT) return 0;
+    if (z < 0 || z >= MAP_WIDTH) return 0;
     MapEntry *entry = map->data + index;
     while (!EMPTY_ENTRY(entry)) {
         if (entry->e.x == x && entry->e.y == y && entry->e.z == z) {
@@ -96,19 +301,154 @@ int map_get(Map *map, int x, int y, int z) {
     return 0;
 }
 
-void map_grow(Map *map) {
+static void map_rehash(Map *map, unsigned int mask) {
     Map new_map;
     new_map.dx = map->dx;
     new_map.dy = map->dy;
     new_map.dz = map->dz;
-    new_map.mask = (map->mask << 1) | 1;
+    new_map.mask = mask;
     new_map.size = 0;
-    new_map.data = (MapEntry *)calloc(new_map.mask + 1, sizeof(MapEntry));
-    MAP_FOR_EACH(map, ex, ey, ez, ew) {
-        map_set(&new_map, ex, ey, ez, ew);
-    } END_MAP_FOR_EACH;
-    free(map->data);
+    memset(new_map.sections, 0, sizeof(new_map.sections));
+    new_map.data = map_data_alloc(new_map.mask, 1);
+    // only the entries are needed, not their world coordinates
+    for (unsigned int word = 0; word < MAP_WORDS(map->mask); word++) {
+        unsigned int bits = MAP_BITS(map)[word];
+        for (; bits; bits &= bits - 1) {
+            map_insert(&new_map, map->data[(word << 5) + MAP_CTZ(bits)]);
+        }
+    }
+    map_data_release(map->data, map->mask);
     map->mask = new_map.mask;
     map->size = new_map.size;
+    memcpy(map->sections, new_map.sections, sizeof(map->sections));
     map->data = new_map.data;
 }
+
+void map_grow(Map *map) {
+    map_rehash(map, (map->mask << 1) | 1);
+}
+
+void map_reserve(Map *map, unsigned int count) {
+    unsigned int mask = map->mask;
+    while (count * 2 > mask) {
+        mask = (mask << 1) | 1;
+    }
+    if (mask != map->mask) {
+        map_rehash(map, mask);
+    }
+}
+
+void map_stats(Map *map, MapStats *stats) {
+    unsigned long total = 0;
+    stats->size = map->size;
+    stats->capacity = map->mask + 1;
+    stats->max_probe = 0;
+    for (unsigned int word = 0; word < MAP_WORDS(map->mask); word++) {
+        unsigned int bits = MAP_BITS(map)[word];
+        for (; bits; bits &= bits - 1) {
+            unsigned int distance = map_distance(map, (word << 5) + MAP_CTZ(bits));
+            stats->max_probe = distance > stats->max_probe ? distance : stats->max_probe;
+            total += distance;
+        }
+    }
+    stats->mean_probe = map->size ? (float)total / map->size : 0;
+    stats->load = (float)map->size / stats->capacity;
+}
+
+int map_top(Map *map) {
+    for (int i = MAP_SECTIONS - 1; i >= 0; i--) {
+        if (!MAP_SECTION_EMPTY(map, i)) {
+            return map->dy + (i + 1) * SECTION_HEIGHT;
+        }
+    }
+    return map->dy;
+}
+
+size_t map_bytes(Map *map) {
+    return map->data ? sizeof(MapEntry) + map_data_size(map->mask) : 0;
+}
+
+size_t packed_map_bytes(PackedMap *packed) {
+    return packed->count * sizeof(MapRun);
+}
+
+// orders entries by column, then up the column
+static unsigned int map_column_key(MapEntry entry) {
+    return (entry.e.x << 18) | (entry.e.z << 12) | entry.e.y;
+}
+
+static int map_column_compare(const void *a, const void *b) {
+    unsigned int ka = map_column_key(*(const MapEntry *)a);
+    unsigned int kb = map_column_key(*(const MapEntry *)b);
+    return ka < kb ? -1 : ka > kb;
+}
+
+// collects the entries of src as column runs into dst->runs
+static void map_pack_runs(PackedMap *dst, Map *src) {
+    dst->count = 0;
+    dst->runs = 0;
+    if (!src->size) {
+        return;
+    }
+    MapEntry *entries = (MapEntry *)malloc(sizeof(MapEntry) * src->size);
+    unsigned int n = 0;
+    for (unsigned int word = 0; word < MAP_WORDS(src->mask); word++) {
+        unsigned int bits = MAP_BITS(src)[word];
+        for (; bits; bits &= bits - 1) {
+            entries[n++] = src->data[(word << 5) + MAP_CTZ(bits)];
+        }
+    }
+    qsort(entries, n, sizeof(MapEntry), map_column_compare);
+    MapRun *runs = (MapRun *)malloc(sizeof(MapRun) * n);
+    for (unsigned int i = 0; i < n; i++) {
+        MapEntry *e = entries + i;
+        if (dst->count) {
+            MapRun *run = runs + dst->count - 1;
+            if (run->start.e.x == e->e.x && run->start.e.z == e->e.z &&
+                run->start.e.w == e->e.w &&
+                run->start.e.y + run->count == e->e.y) {
+                run->count++;
+                continue;
+            }
+        }
+        MapRun *run = runs + dst->count++;
+        run->start = *e;
+        run->count = 1;
+    }
+    free(entries);
+    dst->runs = (MapRun *)realloc(runs, sizeof(MapRun) * dst->count);
+}
+
+void map_pack(PackedMap *dst, Map *src) {
+    dst->dx = src->dx;
+    dst->dy = src->dy;
+    dst->dz = src->dz;
+    dst->mask = src->mask;
+    dst->size = src->size;
+    map_pack_runs(dst, src);
+    map_free(src);
+    src->size = 0;
+    memset(src->sections, 0, sizeof(src->sections));
+    src->data = 0;
+}
+
+void map_unpack(Map *dst, PackedMap *src) {
+    map_alloc(dst, src->dx, src->dy, src->dz, src->mask);
+    for (unsigned int i = 0; i < src->count; i++) {
+        MapRun *run = src->runs + i;
+        int x = run->start.e.x + src->dx;
+        int y = run->start.e.y + src->dy;
+        int z = run->start.e.z + src->dz;
+        for (int j = 0; j < run->count; j++) {
+            map_put(dst, x, y + j, z, run->start.e.w);
+        }
+    }
+    packed_map_free(src);
+}
+
+void packed_map_free(PackedMap *packed) {
+    free(packed->runs);
+    packed->runs = 0;
+    packed->count = 0;
+    packed->size = 0;
+}
@@ -1,14 +1,38 @@
 #ifndef _map_h_
 #define _map_h_
 
+#include <stddef.h>
+#include "config.h"
+
 #define EMPTY_ENTRY(entry) ((entry)->value == 0)
 
+// extent of a map around its origin. a chunk map needs CHUNK_SIZE + 2
+// columns each way, and enough rows for the world with its one block
+// pad, rounded up to whole sections.
+#define MAP_WIDTH 64
+#define MAP_SECTIONS (WORLD_HEIGHT / SECTION_HEIGHT + 1)
+#define MAP_HEIGHT (MAP_SECTIONS * SECTION_HEIGHT)
+#define MAP_SECTION_EMPTY(map, section) (!(map)->sections[section])
+
+// every table is followed by an occupancy bitmap with one bit per slot,
+// so iteration skips empty runs a word at a time
+#define MAP_WORDS(mask) (((mask) >> 5) + 1)
+#define MAP_BITS(map) ((unsigned int *)((map)->data + (map)->mask + 1))
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define MAP_CTZ(bits) __builtin_ctz(bits)
+#else
+    int map_ctz(unsigned int bits);
+    #define MAP_CTZ(bits) map_ctz(bits)
+#endif
+
+// a single loop over the set bits, so that break leaves the whole
+// iteration. _word is the index of the next bitmap word to load
 #define MAP_FOR_EACH(map, ex, ey, ez, ew) \
-    for (unsigned int i = 0; i <= map->mask; i++) { \
+    for (unsigned int _word = 0, _bits = 0; \
+        map_next_bits(map, &_word, &_bits); _bits &= _bits - 1) { \
+        unsigned int i = ((_word - 1) << 5) + MAP_CTZ(_bits); \
         MapEntry *entry = map->data + i; \
-        if (EMPTY_ENTRY(entry)) { \
-            continue; \
-        } \
         int ex = entry->e.x + map->dx; \
         int ey = entry->e.y + map->dy; \
         int ez = entry->e.z + map->dz; \
@@ -19,10 +43,10 @@
 typedef union {
     unsigned int value;
     struct {
-        unsigned char x;
-        unsigned char y;
-        unsigned char z;
-        char w;
+        unsigned int x : 6;
+        unsigned int y : 12;
+        unsigned int z : 6;
+        signed int w : 8;
     } e;
 } MapEntry;
 
@@ -32,14 +56,83 @@ typedef struct {
     int dz;
     unsigned int mask;
     unsigned int size;
+    unsigned int sections[MAP_SECTIONS];
     MapEntry *data;
 } Map;
 
+// loads bitmap words until one has a set bit; 0 once they run out
+static inline int map_next_bits(
+    Map *map, unsigned int *word, unsigned int *bits)
+{
+    while (!*bits) {
+        if (*word >= MAP_WORDS(map->mask)) {
+            return 0;
+        }
+        *bits = MAP_BITS(map)[(*word)++];
+    }
+    return 1;
+}
+
+// a map packed for cold storage: its entries as runs of one block type
+// going up a column, in column order. terrain columns are mostly a
+// single run, so this is far smaller than the hash table.
+typedef struct {
+    MapEntry start;
+    unsigned short count;
+} MapRun;
+
+typedef struct {
+    int dx;
+    int dy;
+    int dz;
+    unsigned int mask;
+    unsigned int size;
+    unsigned int count;
+    MapRun *runs;
+} PackedMap;
+
+typedef struct {
+    unsigned int size;
+    unsigned int capacity;
+    unsigned int max_probe;
+    float mean_probe;
+    float load;
+} MapStats;
+
+// map_pool_init must be called before any map is allocated; tables are
+// recycled through a pool that is shared by all threads.
+void map_pool_init();
+void map_pool_free();
 void map_alloc(Map *map, int dx, int dy, int dz, int mask);
 void map_free(Map *map);
 void map_copy(Map *dst, Map *src);
+// map_move hands the table of src over to dst, freeing the old table of
+// dst. src is left empty and only needs map_free.
+void map_move(Map *dst, Map *src);
+// map_share makes dst a read-only snapshot of src without copying the
+// table; whichever of them is modified first takes a private copy.
+// snapshots of one table must be taken and freed on the same thread.
+void map_share(Map *dst, Map *src);
 void map_grow(Map *map);
+// map_reserve grows the table once so that it can hold count entries
+// without rehashing.
+void map_reserve(Map *map, unsigned int count);
 int map_set(Map *map, int x, int y, int z, int w);
+// map_put is map_set for bulk loads into a reserved table: the coordinates
+// must already lie within the map.
+int map_put(Map *map, int x, int y, int z, int w);
 int map_get(Map *map, int x, int y, int z);
+void map_stats(Map *map, MapStats *stats);
+// one past the highest y covered by a non-empty section, or dy when the
+// map is empty
+int map_top(Map *map);
+// bytes held by the table of a map, or by a packed map
+size_t map_bytes(Map *map);
+size_t packed_map_bytes(PackedMap *packed);
+// map_pack packs src into dst and leaves src empty, like map_move;
+// map_unpack restores it and frees the packed runs.
+void map_pack(PackedMap *dst, Map *src);
+void map_unpack(Map *dst, PackedMap *src);
+void packed_map_free(PackedMap *packed);
 
 #endif
@@ -0,0 +1,323 @@
+#include "tinycthread.h"
+#include <stdlib.h>
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+#include "scheduler.h"
+
+// each thread owns a deque that sched_submit fills in the order work was
+// asked for, best first. the owner and the idle threads that steal from
+// it all take from the top, so jobs run in that order
+typedef struct {
+    mtx_t mtx;
+    Job **jobs;
+    int capacity;
+    int start;
+    int size;
+} Deque;
+
+static int thread_count;
+static thrd_t threads[MAX_SCHED_THREADS];
+static Deque deques[MAX_SCHED_THREADS];
+static Deque urgent;
+static int next_deque;
+static int pending;
+
+// queued counts jobs sitting in any deque; threads sleep on cnd while
+// it is zero
+static mtx_t mtx;
+static cnd_t cnd;
+static int queued;
+static int running;
+
+// a sched_parallel call. its job is queued once per helper; the caller
+// and each helper that runs hold a reference, and the last one frees it
+typedef struct {
+    Job job;
+    void (*func)(void *arg, int index);
+    void *arg;
+    int count;
+    int next;
+    int left;
+    int refs;
+    mtx_t mtx;
+    cnd_t cnd;
+} Batch;
+
+// finished jobs, oldest first, waiting for sched_poll. done_cnd is
+// signalled whenever one is added
+static mtx_t done_mtx;
+static cnd_t done_cnd;
+static Job *done_head;
+static Job *done_tail;
+
+static void deque_push(Deque *deque, Job *job) {
+    mtx_lock(&deque->mtx);
+    if (deque->size == deque->capacity) {
+        int capacity = deque->capacity ? deque->capacity * 2 : 16;
+        Job **jobs = (Job **)malloc(sizeof(Job *) * capacity);
+        for (int i = 0; i < deque->size; i++) {
+            jobs[i] = deque->jobs[(deque->start + i) % deque->capacity];
+        }
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->capacity = capacity;
+        deque->start = 0;
+    }
+    deque->jobs[(deque->start + deque->size++) % deque->capacity] = job;
+    mtx_unlock(&deque->mtx);
+}
+
+static Job *deque_take(Deque *deque) {
+    Job *job = 0;
+    mtx_lock(&deque->mtx);
+    if (deque->size) {
+        job = deque->jobs[deque->start];
+        deque->start = (deque->start + 1) % deque->capacity;
+        deque->size--;
+    }
+    mtx_unlock(&deque->mtx);
+    return job;
+}
+
+static Job *sched_take(int thread) {
+    Job *job = deque_take(&urgent);
+    if (!job) {
+        job = deque_take(deques + thread);
+    }
+    for (int i = 1; !job && i < thread_count; i++) {
+        job = deque_take(deques + (thread + i) % thread_count);
+    }
+    return job;
+}
+
+static int sched_run(void *arg) {
+    int thread = (int)(size_t)arg;
+    while (1) {
+        Job *job = sched_take(thread);
+        if (job) {
+            mtx_lock(&mtx);
+            queued--;
+            mtx_unlock(&mtx);
+            // batch helpers have no done callback and may be freed by run
+            int report = job->done != 0;
+            job->run(job, thread);
+            if (!report) {
+                continue;
+            }
+            job->next = 0;
+            mtx_lock(&done_mtx);
+            if (done_tail) {
+                done_tail->next = job;
+            }
+            else {
+                done_head = job;
+            }
+            done_tail = job;
+            cnd_signal(&done_cnd);
+            mtx_unlock(&done_mtx);
+            continue;
+        }
+        mtx_lock(&mtx);
+        while (running && !queued) {
+            cnd_wait(&cnd, &mtx);
+        }
+        int stop = !running && !queued;
+        if (stop) {
+            // cnd_broadcast in the bundled tinycthread wakes only one
+            // thread on posix, so pass the wakeup along
+            cnd_signal(&cnd);
+        }
+        mtx_unlock(&mtx);
+        if (stop) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int sched_cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? count : 1;
+}
+
+void sched_start(int count) {
+    // by default leave one core to the thread that renders
+    if (count <= 0) {
+        count = sched_cpu_count() - 1;
+    }
+    count = count < 1 ? 1 : count;
+    count = count > MAX_SCHED_THREADS ? MAX_SCHED_THREADS : count;
+    thread_count = count;
+    next_deque = 0;
+    pending = 0;
+    queued = 0;
+    running = 1;
+    done_head = done_tail = 0;
+    mtx_init(&mtx, mtx_plain);
+    mtx_init(&done_mtx, mtx_plain);
+    cnd_init(&cnd);
+    cnd_init(&done_cnd);
+    for (int i = 0; i <= thread_count; i++) {
+        Deque *deque = i < thread_count ? deques + i : &urgent;
+        deque->jobs = 0;
+        deque->capacity = 0;
+        deque->start = 0;
+        deque->size = 0;
+        mtx_init(&deque->mtx, mtx_plain);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        thrd_create(threads + i, sched_run, (void *)(size_t)i);
+    }
+}
+
+// waits for every submitted job to run; their done callbacks are left
+// for a final sched_poll
+void sched_stop() {
+    mtx_lock(&mtx);
+    running = 0;
+    cnd_broadcast(&cnd);
+    mtx_unlock(&mtx);
+    for (int i = 0; i < thread_count; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    for (int i = 0; i <= thread_count; i++) {
+        Deque *deque = i < thread_count ? deques + i : &urgent;
+        mtx_destroy(&deque->mtx);
+        free(deque->jobs);
+        deque->jobs = 0;
+    }
+    cnd_destroy(&cnd);
+    cnd_destroy(&done_cnd);
+    mtx_destroy(&mtx);
+    thread_count = 0;
+}
+
+int sched_threads() {
+    return thread_count;
+}
+
+static void sched_wake() {
+    pending++;
+    mtx_lock(&mtx);
+    queued++;
+    cnd_signal(&cnd);
+    mtx_unlock(&mtx);
+}
+
+void sched_submit(Job *job) {
+    deque_push(deques + next_deque, job);
+    next_deque = (next_deque + 1) % thread_count;
+    sched_wake();
+}
+
+void sched_submit_urgent(Job *job) {
+    deque_push(&urgent, job);
+    sched_wake();
+}
+
+static void batch_work(Batch *batch) {
+    while (1) {
+        mtx_lock(&batch->mtx);
+        int index = batch->next < batch->count ? batch->next++ : -1;
+        mtx_unlock(&batch->mtx);
+        if (index < 0) {
+            break;
+        }
+        batch->func(batch->arg, index);
+        mtx_lock(&batch->mtx);
+        if (!--batch->left) {
+            cnd_signal(&batch->cnd);
+        }
+        mtx_unlock(&batch->mtx);
+    }
+}
+
+static void batch_release(Batch *batch) {
+    mtx_lock(&batch->mtx);
+    int last = !--batch->refs;
+    mtx_unlock(&batch->mtx);
+    if (last) {
+        mtx_destroy(&batch->mtx);
+        cnd_destroy(&batch->cnd);
+        free(batch);
+    }
+}
+
+static void batch_run(Job *job, int thread) {
+    Batch *batch = (Batch *)job;
+    batch_work(batch);
+    batch_release(batch);
+}
+
+void sched_parallel(void (*func)(void *arg, int index), void *arg, int count) {
+    int helpers = count - 1 < thread_count ? count - 1 : thread_count;
+    if (helpers <= 0) {
+        for (int i = 0; i < count; i++) {
+            func(arg, i);
+        }
+        return;
+    }
+    Batch *batch = (Batch *)malloc(sizeof(Batch));
+    batch->job.run = batch_run;
+    batch->job.done = 0;
+    batch->func = func;
+    batch->arg = arg;
+    batch->count = count;
+    batch->next = 0;
+    batch->left = count;
+    batch->refs = helpers + 1;
+    mtx_init(&batch->mtx, mtx_plain);
+    cnd_init(&batch->cnd);
+    for (int i = 0; i < helpers; i++) {
+        deque_push(&urgent, &batch->job);
+    }
+    mtx_lock(&mtx);
+    queued += helpers;
+    for (int i = 0; i < helpers; i++) {
+        cnd_signal(&cnd);
+    }
+    mtx_unlock(&mtx);
+    batch_work(batch);
+    mtx_lock(&batch->mtx);
+    while (batch->left) {
+        cnd_wait(&batch->cnd, &batch->mtx);
+    }
+    mtx_unlock(&batch->mtx);
+    batch_release(batch);
+}
+
+// jobs submitted whose done callback has not run yet
+int sched_pending() {
+    return pending;
+}
+
+void sched_poll() {
+    mtx_lock(&done_mtx);
+    Job *job = done_head;
+    done_head = done_tail = 0;
+    mtx_unlock(&done_mtx);
+    while (job) {
+        Job *next = job->next;
+        pending--;
+        job->done(job);
+        job = next;
+    }
+}
+
+void sched_drain() {
+    while (pending) {
+        mtx_lock(&done_mtx);
+        while (!done_head) {
+            cnd_wait(&done_cnd, &done_mtx);
+        }
+        mtx_unlock(&done_mtx);
+        sched_poll();
+    }
+}
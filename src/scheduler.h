@@ -0,0 +1,33 @@
+#ifndef _scheduler_h_
+#define _scheduler_h_
+
+#define MAX_SCHED_THREADS 64
+
+// a unit of background work. run is called on a scheduler thread with
+// that thread's index; done is called later on the thread that calls
+// sched_poll. embed a Job at the start of a larger struct to pass data.
+typedef struct Job {
+    void (*run)(struct Job *job, int thread);
+    void (*done)(struct Job *job);
+    struct Job *next;
+} Job;
+
+int sched_cpu_count();
+void sched_start(int count);
+void sched_stop();
+int sched_threads();
+void sched_submit(Job *job);
+// urgent jobs are taken, oldest first, before any job from sched_submit
+void sched_submit_urgent(Job *job);
+int sched_pending();
+// runs func(arg, index) for every index below count and returns once all
+// of them are done. idle scheduler threads join in through the urgent
+// lane while the calling thread works through the indices itself, so it
+// may be called from a job or from any other thread.
+void sched_parallel(void (*func)(void *arg, int index), void *arg, int count);
+void sched_poll();
+// waits for every submitted job to finish, including jobs submitted by
+// done callbacks, and runs their done callbacks on the calling thread
+void sched_drain();
+
+#endif
@@ -6,20 +6,20 @@
 #include "sign.h"
 #include "map.h"
 #include "tinycthread.h"
+#include "scheduler.h"
 #include "config.h"
 
 #define MAX_NAME_LENGTH 32
 #define MAX_PLAYERS 128
-#define WORKERS 4
 #define MAX_TEXT_LENGTH 256
 #define MAX_PATH_LENGTH 256
 #define MAX_ADDR_LENGTH 256
-#define MAX_CHUNKS 8192
+#define CHUNK_PAGE_SIZE 256
 
 /// [issue](https://github.com/WSU-CEG-6110-4410/Remainders-Craft/issues/8)
 /// These structs were derived from main.c. Further documentation is necessary.
 
-typedef struct
+typedef struct Chunk
 {
     Map map;
     Map lights;
@@ -33,30 +33,221 @@ typedef struct
     int maxy;
     GLuint buffer;
     GLuint sign_buffer;
+    /// The loaded chunks of the 3x3 neighborhood, indexed by
+    /// [dp + 1][dq + 1], or 0 where a neighbor is not loaded.
+    struct Chunk *neighbors[3][3];
+    /// Stable index of the chunk in the chunk table.
+    int slot;
+    /// Bumped every time the slot is released, invalidating handles.
+    int generation;
+    /// Position of the chunk in the list of live chunks.
+    int order;
+    /// Set while a worker holds a job for this chunk.
+    int busy;
+    /// Set once the chunk's blocks and lights have been loaded.
+    int loaded;
+    /// Times the chunk was set dirty since its last mesh was started, and
+    /// glfwGetTime() when that was.
+    int edits;
+    double mesh_time;
+    /// Set while the chunk is in Model.held_chunks.
+    int held;
+    /// Set while map and lights are empty and the blocks and lights are
+    /// held in packed_map and packed_lights instead.
+    int packed;
+    PackedMap packed_map;
+    PackedMap packed_lights;
 } Chunk;
 
+/// A chunk that is waiting for a worker, and the score it was queued
+/// with. Lower scores are handed out first.
 typedef struct
 {
     int p;
     int q;
-    int load;
+    int score;
+} ChunkJob;
+
+/// Binary min-heap of ChunkJobs.
+typedef struct
+{
+    ChunkJob *jobs;
+    int size;
+    int capacity;
+} ChunkHeap;
+
+/// The chunks around the player that are missing, in the load heap, and
+/// that are loaded but dirty, in the mesh heap. It is rebuilt when the
+/// player enters another chunk or turns far enough to change which
+/// chunks are visible; in between, chunks are pushed as they become
+/// dirty. Jobs that go stale stay in their heap and are skipped when
+/// popped.
+typedef struct
+{
+    ChunkHeap load;
+    ChunkHeap mesh;
+    /// Cleared when the chunk table is emptied, forcing a rebuild.
+    int valid;
+    /// The view the queue was last rebuilt for.
+    int p;
+    int q;
+    int radius;
+    float rx;
+    float ry;
+    float fov;
+    int ortho;
+    /// The chunk the player is predicted to be in PREFETCH_TIME seconds
+    /// from the last rebuild.
+    int predicted_p;
+    int predicted_q;
+    /// Smoothed horizontal velocity of the player, from its position and
+    /// the time at the previous update.
+    float vx;
+    float vz;
+    float x;
+    float z;
+    double time;
+    /// Distance and visibility part of the score of every chunk within
+    /// radius of (p, q), row by row.
+    int *scores;
+} ChunkQueue;
+
+/// Running totals of the chunk work done, shown with SHOW_CHUNK_STATS.
+typedef struct
+{
+    /// Chunks loaded from the world generator and database.
+    int loads;
+    /// Chunks brought back from the chunk cache instead.
+    int revives;
+    /// Meshes built, and how many of them replaced an earlier mesh.
+    int meshes;
+    int remeshes;
+    /// Mesh jobs put off because a side neighbor was still loading.
+    int deferrals;
+    /// Meshes held back because the chunk was being edited too quickly.
+    int holds;
+} ChunkStats;
+
+/// A chunk that the residency manager may demote, with the distance to
+/// the nearest observer and Model.frame when it was last drawn.
+typedef struct
+{
+    Chunk *chunk;
+    int distance;
+    int used;
+} ResidencyCandidate;
+
+/// The contents of a chunk that was deleted for being out of range, kept
+/// so that it can be brought back without loading and meshing it again.
+typedef struct
+{
+    int p;
+    int q;
+    Map map;
+    Map lights;
+    SignList signs;
+    int faces;
+    int sign_faces;
+    int dirty;
+    int miny;
+    int maxy;
+    GLuint buffer;
+    GLuint sign_buffer;
+    /// ChunkCache.tick when the chunk was deleted.
+    int used;
+} CachedChunk;
+
+/// The most recently deleted chunks. Once it is full, the chunk that was
+/// deleted longest ago makes room. An entry is dropped when its chunk is
+/// brought back or edited.
+typedef struct
+{
+    CachedChunk entries[CHUNK_CACHE_SIZE];
+    int count;
+    int tick;
+} ChunkCache;
+
+/// The fields of the live chunks that per-frame passes need, as
+/// parallel arrays indexed like Model.chunks (i.e. by Chunk.order).
+/// Sweeping these keeps the cold map and sign data out of the cache.
+typedef struct
+{
+    int *p;
+    int *q;
+    int *miny;
+    int *maxy;
+    int *faces;
+    int *sign_faces;
+    GLuint *buffer;
+    GLuint *sign_buffer;
+    /// Bytes of block, light and sign data, and of GL buffers.
+    int *ram;
+    int *vram;
+    /// Model.frame when the chunk was last drawn.
+    int *used;
+} ChunkHot;
+
+/// A reference to a chunk that can be held across frames, e.g. by
+/// worker jobs. It resolves to nothing once the chunk is deleted.
+typedef struct
+{
+    int slot;
+    int generation;
+} ChunkHandle;
+
+/// A chunk load or mesh job. The Job comes first so the scheduler's
+/// callbacks can cast it back to the item.
+typedef struct
+{
+    Job job;
+    int p;
+    int q;
+    ChunkHandle chunk;
     Map *block_maps[3][3];
     Map *light_maps[3][3];
     int miny;
     int maxy;
     int faces;
     GLfloat *data;
+    /// Set for chunks near the player, which are meshed as several slabs
+    /// in parallel.
+    int urgent;
 } WorkerItem;
 
+/// A vertical slab of a chunk that is being meshed: the blocks of map
+/// with y in [y1, y2), the working volume compute_chunk built around
+/// them, and the faces generated for them.
+typedef struct
+{
+    Map *map;
+    char *opaque;
+    char *light;
+    short *highest;
+    int n;
+    int ox;
+    int oy;
+    int oz;
+    int y1;
+    int y2;
+    int miny;
+    int maxy;
+    int faces;
+    GLfloat *data;
+} MeshSlab;
+
+/// Scratch buffers that compute_chunk reuses between calls. They are
+/// all zero between calls.
 typedef struct
 {
-    int index;
-    int state;
-    thrd_t thrd;
-    mtx_t mtx;
-    cnd_t cnd;
-    WorkerItem item;
-} Worker;
+    char *opaque;
+    char *light;
+    short *highest;
+    /// Width of the working volume that highest is sized for, 0 before
+    /// the first call.
+    int n;
+    /// Number of values that opaque and light hold.
+    int size;
+} Scratch;
 
 typedef struct
 {
@@ -106,9 +297,35 @@ typedef struct
 typedef struct
 {
     GLFWwindow *window;
-    Worker workers[WORKERS];
-    Chunk chunks[MAX_CHUNKS];
+    Scratch scratch;
+    /// Scratch buffers of each scheduler thread.
+    Scratch worker_scratch[MAX_SCHED_THREADS];
+    /// Live chunks, in no particular order. The chunks themselves live
+    /// in chunk_pages and never move while they are loaded.
+    Chunk **chunks;
     int chunk_count;
+    ChunkHot chunk_hot;
+    int chunk_capacity;
+    Chunk **chunk_pages;
+    int *chunk_free;
+    int chunk_free_count;
+    int *chunk_index;
+    unsigned int chunk_index_mask;
+    ChunkQueue chunk_queue;
+    ChunkCache chunk_cache;
+    ChunkStats chunk_stats;
+    /// Dirty chunks whose meshing is held back until REMESH_INTERVAL has
+    /// passed since their last mesh.
+    ChunkHandle *held_chunks;
+    int held_count;
+    int held_capacity;
+    /// Load and mesh jobs submitted to the scheduler and not done yet.
+    int load_jobs;
+    int mesh_jobs;
+    /// Bytes of chunk data and of chunk GL buffers to keep resident.
+    size_t ram_budget;
+    size_t vram_budget;
+    int frame;
     int create_radius;
     int render_radius;
     int delete_radius;
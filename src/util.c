@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
 #include "lodepng.h"
 #include "matrix.h"
 #include "util.h"
@@ -16,6 +21,19 @@ double rand_double() {
     return (double)rand() / (double)RAND_MAX;
 }
 
+size_t physical_memory() {
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    GlobalMemoryStatusEx(&status);
+    return (size_t)status.ullTotalPhys;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    return pages > 0 && page_size > 0 ? (size_t)pages * page_size : 0;
+#endif
+}
+
 void update_fps(FPS *fps) {
     fps->frames++;
     double now = glfwGetTime();
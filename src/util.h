@@ -27,6 +27,7 @@ typedef struct {
 
 int rand_int(int n);
 double rand_double();
+size_t physical_memory();
 void update_fps(FPS *fps);
 
 GLuint gen_buffer(GLsizei size, GLfloat *data);
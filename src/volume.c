@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include "volume.h"
+
+static int volume_bytes(int bits) {
+    return VOLUME_SECTION_VOXELS / 8 * bits;
+}
+
+static int volume_load(VolumeSection *section, int index) {
+    int bit = index * section->bits;
+    int mask = (1 << section->bits) - 1;
+    return (section->data[bit >> 3] >> (bit & 7)) & mask;
+}
+
+static void volume_store(VolumeSection *section, int index, int value) {
+    int bit = index * section->bits;
+    int mask = ((1 << section->bits) - 1) << (bit & 7);
+    unsigned char *byte = section->data + (bit >> 3);
+    *byte = (*byte & ~mask) | ((value << (bit & 7)) & mask);
+}
+
+static void volume_repack(VolumeSection *section, int bits) {
+    VolumeSection new_section;
+    new_section.bits = bits;
+    new_section.data = (unsigned char *)calloc(
+        volume_bytes(bits), sizeof(unsigned char));
+    if (section->bits) {
+        for (int i = 0; i < VOLUME_SECTION_VOXELS; i++) {
+            int value = volume_load(section, i);
+            if (value) {
+                volume_store(&new_section, i, value);
+            }
+        }
+    }
+    free(section->data);
+    section->bits = new_section.bits;
+    section->data = new_section.data;
+}
+
+static int volume_palette_index(VolumeSection *section, int w) {
+    int index = section->lookup[(unsigned char)w];
+    if (index < section->palette_size && section->palette[index] == w) {
+        return index;
+    }
+    if (section->palette_size == (1 << section->bits)) {
+        volume_repack(section, section->bits ? section->bits * 2 : 1);
+    }
+    index = section->palette_size++;
+    section->palette[index] = w;
+    section->lookup[(unsigned char)w] = index;
+    return index;
+}
+
+static VolumeSection *volume_section_alloc() {
+    VolumeSection *section = (VolumeSection *)calloc(1, sizeof(VolumeSection));
+    section->palette_size = 1;
+    section->miny = SECTION_HEIGHT;
+    section->maxy = -1;
+    return section;
+}
+
+static void volume_section_free(VolumeSection *section) {
+    if (section) {
+        free(section->data);
+        free(section);
+    }
+}
+
+void volume_alloc(Volume *volume, int dx, int dy, int dz) {
+    volume->dx = dx;
+    volume->dy = dy;
+    volume->dz = dz;
+    volume->size = 0;
+    memset(volume->sections, 0, sizeof(volume->sections));
+}
+
+void volume_free(Volume *volume) {
+    for (int i = 0; i < VOLUME_SECTIONS; i++) {
+        volume_section_free(volume->sections[i]);
+        volume->sections[i] = 0;
+    }
+}
+
+void volume_copy(Volume *dst, Volume *src) {
+    memcpy(dst, src, sizeof(Volume));
+    for (int i = 0; i < VOLUME_SECTIONS; i++) {
+        VolumeSection *section = src->sections[i];
+        if (!section) {
+            continue;
+        }
+        int n = volume_bytes(section->bits);
+        dst->sections[i] = (VolumeSection *)malloc(sizeof(VolumeSection));
+        memcpy(dst->sections[i], section, sizeof(VolumeSection));
+        dst->sections[i]->data = (unsigned char *)malloc(n);
+        memcpy(dst->sections[i]->data, section->data, n);
+    }
+}
+
+int volume_set(Volume *volume, int x, int y, int z, int w) {
+    x -= volume->dx;
+    y -= volume->dy;
+    z -= volume->dz;
+    if (x < 0 || x >= VOLUME_WIDTH) return 0;
+    if (y < 0 || y >= VOLUME_HEIGHT) return 0;
+    if (z < 0 || z >= VOLUME_WIDTH) return 0;
+    w = (signed char)w;
+    VolumeSection **slot = volume->sections + y / SECTION_HEIGHT;
+    y %= SECTION_HEIGHT;
+    if (!*slot) {
+        if (!w) {
+            return 0;
+        }
+        *slot = volume_section_alloc();
+    }
+    VolumeSection *section = *slot;
+    int index = VOLUME_INDEX(x, y, z);
+    int current = section->bits ? volume_load(section, index) : 0;
+    if (section->palette[current] == w) {
+        return 0;
+    }
+    int value = volume_palette_index(section, w);
+    volume_store(section, index, value);
+    if (!current) {
+        section->size++;
+        volume->size++;
+        // bounds only widen; removals leave them conservative
+        section->miny = y < section->miny ? y : section->miny;
+        section->maxy = y > section->maxy ? y : section->maxy;
+    }
+    if (!value) {
+        section->size--;
+        volume->size--;
+    }
+    if (!section->size) {
+        volume_section_free(section);
+        *slot = 0;
+    }
+    return 1;
+}
+
+int volume_get(Volume *volume, int x, int y, int z) {
+    x -= volume->dx;
+    y -= volume->dy;
+    z -= volume->dz;
+    if (x < 0 || x >= VOLUME_WIDTH) return 0;
+    if (y < 0 || y >= VOLUME_HEIGHT) return 0;
+    if (z < 0 || z >= VOLUME_WIDTH) return 0;
+    VolumeSection *section = volume->sections[y / SECTION_HEIGHT];
+    if (!section) {
+        return 0;
+    }
+    y %= SECTION_HEIGHT;
+    return section->palette[volume_load(section, VOLUME_INDEX(x, y, z))];
+}
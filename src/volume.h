@@ -0,0 +1,68 @@
+#ifndef _volume_h_
+#define _volume_h_
+
+#include "config.h"
+
+// dense, palette-compressed block storage for a single chunk column.
+// covers the same footprint as a chunk Map: the chunk itself plus its
+// one block border, over the full world height. the column is split into
+// sections of SECTION_HEIGHT rows; sections that hold only air are not
+// allocated at all.
+#define VOLUME_WIDTH (CHUNK_SIZE + 2)
+#define VOLUME_SECTIONS (WORLD_HEIGHT / SECTION_HEIGHT + 1)
+#define VOLUME_HEIGHT (VOLUME_SECTIONS * SECTION_HEIGHT)
+#define VOLUME_SECTION_VOXELS (VOLUME_WIDTH * VOLUME_WIDTH * SECTION_HEIGHT)
+#define VOLUME_INDEX(x, y, z) \
+    (((y) * VOLUME_WIDTH + (x)) * VOLUME_WIDTH + (z))
+
+#define VOLUME_FOR_EACH(volume, ex, ey, ez, ew) \
+    for (int _s = 0; _s < VOLUME_SECTIONS; _s++) \
+    for (int i = 0; (volume)->sections[_s] && i < VOLUME_SECTION_VOXELS; i++) { \
+        VolumeSection *_section = (volume)->sections[_s]; \
+        int _bit = i * _section->bits; \
+        int _byte = _section->data[_bit >> 3]; \
+        if (!_byte) { \
+            i |= (8 / _section->bits) - 1; \
+            continue; \
+        } \
+        int _index = (_byte >> (_bit & 7)) & ((1 << _section->bits) - 1); \
+        if (!_index) { \
+            continue; \
+        } \
+        int ex = (i / VOLUME_WIDTH) % VOLUME_WIDTH + (volume)->dx; \
+        int ey = i / (VOLUME_WIDTH * VOLUME_WIDTH) + \
+            _s * SECTION_HEIGHT + (volume)->dy; \
+        int ez = i % VOLUME_WIDTH + (volume)->dz; \
+        int ew = _section->palette[_index];
+
+#define END_VOLUME_FOR_EACH }
+
+typedef struct {
+    unsigned int size;
+    int miny;
+    int maxy;
+    int bits;
+    int palette_size;
+    signed char palette[256];
+    unsigned char lookup[256];
+    unsigned char *data;
+} VolumeSection;
+
+#define VOLUME_SECTION_FULL(section) \
+    ((section)->size == VOLUME_SECTION_VOXELS)
+
+typedef struct {
+    int dx;
+    int dy;
+    int dz;
+    unsigned int size;
+    VolumeSection *sections[VOLUME_SECTIONS];
+} Volume;
+
+void volume_alloc(Volume *volume, int dx, int dy, int dz);
+void volume_free(Volume *volume);
+void volume_copy(Volume *dst, Volume *src);
+int volume_set(Volume *volume, int x, int y, int z, int w);
+int volume_get(Volume *volume, int x, int y, int z);
+
+#endif